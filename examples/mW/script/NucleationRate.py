@@ -33,13 +33,21 @@ trajectoryLines = readFileAsLines('trajectory.out.txt')
 
 
 
+replicas = 1
+instances = 1
 for line in ffsInputLines:
+    if re.match('replicas ', line):  # trajectories per universe
+        replicas = int(line.split()[1])
+    if re.match('instances ', line):  # lammps instances per universe, not used with replicas
+        instances = int(line.split()[1])
     if re.match('equilibrium ', line):
         equilibriumSteps = float(line.split(' ')[1])
         
     if re.match('lambda ', line):
         lambdaList = line.split(' ')[1:len(line.split(' '))]
         num_interface = (len(line.split(' '))-3)
+if replicas == 1:
+    replicas = instances
 
 
 for line in lammpsInputLines:
@@ -100,7 +108,7 @@ for i in range(len(targetLambda)):
 totalStep = 0
 for i in simustep:
         if i>equilibriumSteps:
-            totalStep = totalStep+i-equilibriumSteps
+            totalStep = totalStep+(i-equilibriumSteps)*replicas
         else:
             totalStep = totalStep
 
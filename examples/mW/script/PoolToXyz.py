@@ -0,0 +1,61 @@
+import re
+import os
+import struct
+from optparse import OptionParser
+
+# layout written by FfsPoolContainer / FfsSnapshot in ffs.cpp
+RECORD = struct.Struct('48sqq')          # name, offset, size
+HEADER = struct.Struct('q3d3d3d')        # natoms, boxlo, boxhi, xy yz xz
+
+
+def readIndex(filename):
+    entries = {}
+    data = open(filename, 'rb').read()
+    for i in range(len(data) // RECORD.size):
+        name, offset, size = RECORD.unpack_from(data, i * RECORD.size)
+        entries[name.split(b'\0')[0].decode()] = (offset, size)
+    return entries
+
+
+def readSnapshot(dataFile, offset, size):
+    dataFile.seek(offset)
+    data = dataFile.read(size)
+    header = HEADER.unpack_from(data, 0)
+    natoms = header[0]
+    pos = HEADER.size
+    x = struct.unpack_from('%dd' % (3 * natoms), data, pos)
+    pos += 2 * 3 * natoms * 8       # skip velocities
+    pos += 3 * natoms * 4           # skip image flags
+    types = struct.unpack_from('%di' % natoms, data, pos)
+    return x, types
+
+
+def writeXyz(filename, x, types):
+    f = open(filename, 'w')
+    f.write('%d\n' % len(types))
+    f.write(' Atoms. Timestep: 0\n')
+    for i in range(len(types)):
+        f.write('%d %g %g %g\n' % (types[i], x[3 * i], x[3 * i + 1], x[3 * i + 2]))
+    f.close()
+
+
+parser = OptionParser()
+parser.add_option('--pool', type = str, default = 'pool', help = 'Folder of pool.dat and pool.idx (default: %default)')
+parser.add_option('--select', type = str, default = '.*', help = 'Regular expression on the configuration name, e.g. "^3__" (default: %default)')
+parser.add_option('--output', type = str, default = '.', help = 'Folder of the exported xyz.<name> files (default: %default)')
+parser.add_option('--list', action = 'store_true', default = False, help = 'Only print the selected names')
+(options, args) = parser.parse_args()
+
+entries = readIndex(os.path.join(options.pool, 'pool.idx'))
+selected = sorted(name for name in entries if re.search(options.select, name))
+if options.list:
+    for name in selected:
+        print(name)
+else:
+    dataFile = open(os.path.join(options.pool, 'pool.dat'), 'rb')
+    for name in selected:
+        offset, size = entries[name]
+        x, types = readSnapshot(dataFile, offset, size)
+        writeXyz(os.path.join(options.output, 'xyz.' + name), x, types)
+    dataFile.close()
+    print('%d configurations exported' % len(selected))
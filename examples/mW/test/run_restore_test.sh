@@ -0,0 +1,27 @@
+#!/bin/sh
+# restores configurations on universes of 2 ranks with every pool format,
+# a restore that leaves atoms behind aborts with "lost atoms" or a lammps error
+# usage: LMP=path/lmp_mpi sh run_restore_test.sh
+LMP=${LMP:-lmp_mpi}
+HERE=$(cd $(dirname $0) && pwd)
+status=0
+for format in memory container xyz; do
+    dir=$(mktemp -d)
+    cp $HERE/../input/in.data $HERE/../input/Si.sw $HERE/../input/lammps.input $dir
+    cp $HERE/ffs.input $dir
+    echo "pool_format $format" >> $dir/ffs.input
+    mkdir $dir/pool
+    : > $dir/trajectory.in.txt
+    cd $dir
+    mpirun -np 4 $LMP -in lammps.input -screen none -ffs 2 ffs.input > out.txt 2>&1
+    rc=$?
+    if [ $rc -ne 0 ] || grep -qi "lost atoms" out.txt || [ ! -s trajectory.out.txt ]; then
+        echo "restore test with pool_format $format failed, see $dir/out.txt"
+        status=1
+    else
+        echo "restore test with pool_format $format passed"
+        rm -rf $dir
+    fi
+    cd $HERE
+done
+exit $status
@@ -67,12 +67,23 @@ ComputeBiggest::ComputeBiggest(LAMMPS *lmp, int narg, char **arg) :
       error->all(FLERR,"Illegal compute nuclei/atom command");
   }
 
+  //replicas k: the atoms are k copies of the system with consecutive tags, the
+  //vector holds the size and tag of the biggest cluster of each copy in turn
+  nreplicas = 1;
+  iarg += 3;
+  if (iarg < narg) {
+      if (strcmp(arg[iarg],"replicas") != 0 || iarg+2 != narg)
+          error->all(FLERR,"Illegal compute biggest command");
+      nreplicas = utils::inumeric(FLERR,arg[iarg+1],false,lmp);
+      if (nreplicas < 1) error->all(FLERR,"Illegal compute biggest command");
+  }
+
   vector_flag = 1;
-  size_vector = 2;
+  size_vector = 2*nreplicas;
   extscalar = 0;
   extvector = 0;
 
-  vector = new double[2];
+  vector = new double[size_vector];
 }
 
 /* ---------------------------------------------------------------------- */
@@ -153,7 +164,13 @@ void ComputeBiggest::compute_vector()
     //get the global count
   MPI_Allreduce(countLocal,countGlobal,1+maxTag,MPI_INT,MPI_SUM,world);
   
-  //get the tag index with max number of same tag
+  //get the tag index with max number of same tag, the tag of a cluster is
+  //the smallest tag of its atoms, so it tells the replica of the cluster
+  bigint perReplica = atom->natoms/nreplicas;
+  for (int r = 0; r < nreplicas; r++) {
+      vector[2*r] = -1;
+      vector[2*r+1] = 0;
+  }
   int maxCount=-1,iMax;
   for (int i = 1; i <= maxTag; i++) {
 	  int current=countGlobal[i];
@@ -161,6 +178,11 @@ void ComputeBiggest::compute_vector()
 		  maxCount=current;
 		  iMax=i;
 	  }  
+	  int r = MIN((i-1)/perReplica,nreplicas-1);
+	  if (current>vector[2*r]) {
+		  vector[2*r]=current;
+		  vector[2*r+1]=i;
+	  }
   }
 
  
@@ -182,8 +204,10 @@ void ComputeBiggest::compute_vector()
       memory->destroy(flags);
   }
   
-  vector[0]=maxCount;
-  vector[1]=iMax;
+  if (nreplicas == 1) {
+      vector[0]=maxCount;
+      vector[1]=iMax;
+  }
   
   memory->destroy(countGlobal);
   memory->destroy(countLocal);
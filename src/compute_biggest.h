@@ -33,6 +33,7 @@ class ComputeBiggest : public Compute {
 
  private:
   int makegroup;
+  int nreplicas;
   char *groupname;
   Compute *compute_nuclei;
 };
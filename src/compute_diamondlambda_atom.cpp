@@ -14,6 +14,9 @@
 ------------------------------------------------------------------------- */
 
 #include <complex>
+#include <map>
+#include <set>
+#include <vector>
 #include <string.h>
 #include <stdlib.h>
 #include "compute_diamondlambda_atom.h"
@@ -30,9 +33,17 @@
 #include "error.h"
 #include "math_const.h"
 
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
 using namespace LAMMPS_NS;
 using namespace MathConst;
 
+// the q_lm planes are padded to a multiple of this, to fill whole vectors
+#define QLM_PAD 8
+#define QLM_STRIDE(n) (((n)+QLM_PAD-1)/QLM_PAD*QLM_PAD)
+
 /* ---------------------------------------------------------------------- */
 
 ComputeDiamondLambdaAtom::ComputeDiamondLambdaAtom(LAMMPS *lmp, int narg, char **arg) :
@@ -135,16 +146,52 @@ ComputeDiamondLambdaAtom::ComputeDiamondLambdaAtom(LAMMPS *lmp, int narg, char *
   peratom_flag = 1;
   size_peratom_cols = 0;
 
+  // the m dependent part of the normalization, sqrt((2l+1)/4pi*(l-m)!/(l+m)!)
+  memory->create(ylmnorm,ndegree+1,"diamondlambda/atom:ylmnorm");
+  for (int m = 0; m <= ndegree; m++) {
+    double prefactor = 1.0;
+    for (int i = ndegree-m+1; i <= ndegree+m; i++)
+      prefactor *= static_cast<double>(i);
+    ylmnorm[m] = sqrt(static_cast<double>(2*ndegree+1)/(MY_4PI*prefactor));
+  }
+
+  // the usual degrees get kernels with the m loops unrolled
+  switch (ndegree) {
+  case 3:
+    addQlm = &ComputeDiamondLambdaAtom::add_qlm_all<3>;
+    addQn = &ComputeDiamondLambdaAtom::add_qn_complex<3>;
+    break;
+  case 4:
+    addQlm = &ComputeDiamondLambdaAtom::add_qlm_all<4>;
+    addQn = &ComputeDiamondLambdaAtom::add_qn_complex<4>;
+    break;
+  case 6:
+    addQlm = &ComputeDiamondLambdaAtom::add_qlm_all<6>;
+    addQn = &ComputeDiamondLambdaAtom::add_qn_complex<6>;
+    break;
+  case 8:
+    addQlm = &ComputeDiamondLambdaAtom::add_qlm_all<8>;
+    addQn = &ComputeDiamondLambdaAtom::add_qn_complex<8>;
+    break;
+  default:
+    addQlm = &ComputeDiamondLambdaAtom::add_qlm_all<-1>;
+    addQn = &ComputeDiamondLambdaAtom::add_qn_complex<-1>;
+  }
+
   nmax = 0;
+  qlmStride = QLM_STRIDE(2*ndegree+1);
   comm_forward=2*(ndegree*2+1);
   NearestNeighNumber=NULL;          
   hydrogenBondNeigh=NULL;
   hydrogenBondNeigh_big=NULL;   
   qlmarray=NULL;
+  qlnorm = NULL;
   qnvector = NULL;
   isSolid = NULL;
   nucleiID = NULL;
+  clusterParent = NULL;
   maxneigh = 0;
+  maxthreads = 0;
   distsqO = NULL;
   distsqH = NULL;
   nearestO = NULL;
@@ -157,17 +204,20 @@ ComputeDiamondLambdaAtom::~ComputeDiamondLambdaAtom()
 {
   memory->destroy(isSolid);
   memory->destroy(nucleiID);
+  memory->destroy(clusterParent);
   delete[] compareDirection;
   delete[] threshold;
   memory->destroy(NearestNeighNumber);           
   memory->destroy(hydrogenBondNeigh);
   memory->destroy(hydrogenBondNeigh_big);
   memory->destroy(qlmarray);
+  memory->destroy(qlnorm);
   memory->destroy(qnvector);
   memory->destroy(distsqO);
   memory->destroy(distsqH);
   memory->destroy(nearestO);
   memory->destroy(nearestH);
+  memory->destroy(ylmnorm);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -185,8 +235,12 @@ void ComputeDiamondLambdaAtom::init()
       error->all(FLERR, "Compute diamondlambda/atom rsoft is negative");
   }
 
-  // request an occasional full neighbor list
+  // request an occasional full neighbor list, only as long as the
+  // larger of the two cutoffs when that is shorter than the pair cutoff
+  // it is built at most once between two reneighborings
   auto req = neighbor->add_request(this, NeighConst::REQ_FULL | NeighConst::REQ_OCCASIONAL);
+  const double cutlist = sqrt(MAX(cutsq,cutbig));
+  if (cutlist < force->pair->cutforce) req->set_cutoff(cutlist);
 
   int count = 0;
   //allocate the number of the certain type calculated
@@ -212,8 +266,9 @@ int ComputeDiamondLambdaAtom::pack_forward_comm(int n, int *list, double *buf, i
     for (i=0;i<n;i++) {
         j=list[i];
         if (packQlm) {
-            for (int k=0;k<2*(ndegree*2+1);k++) {
+            for (int k=0;k<ndegree*2+1;k++) {
                 buf[m++]=qlmarray[j][k];
+                buf[m++]=qlmarray[j][qlmStride+k];
             }
         }
         if (packSolid) {
@@ -231,8 +286,9 @@ void ComputeDiamondLambdaAtom::unpack_forward_comm(int n, int first, double *buf
     last=first+n;
     for (i=first;i<last;i++) {
         if (packQlm) {
-            for (int k=0;k<2*(ndegree*2+1);k++) {
+            for (int k=0;k<ndegree*2+1;k++) {
                 qlmarray[i][k]=buf[m++];
+                qlmarray[i][qlmStride+k]=buf[m++];
             }
         }
         if (packSolid) {
@@ -265,14 +321,20 @@ void ComputeDiamondLambdaAtom::compute_peratom()
 
   if (atom->nlocal + atom->nghost > nmax) {
     memory->destroy(qlmarray);
+    memory->destroy(qlnorm);
     memory->destroy(qnvector);
     memory->destroy(isSolid);
     memory->destroy(nucleiID);
+    memory->destroy(clusterParent);
     nmax = atom->nmax;
-    memory->create(qlmarray,nmax,(2*ndegree+1)*2,"diamondlambda/atom:qlmarray");
+    memory->create(qlmarray,nmax,2*qlmStride,"diamondlambda/atom:qlmarray");
+    // the padding stays zero, only the 2l+1 values are written later
+    memset(&qlmarray[0][0],0,sizeof(double)*nmax*2*qlmStride);
+    memory->create(qlnorm,nmax,"diamondlambda/atom:qlnorm");
     memory->create(qnvector,nmax,"diamondlambda/atom:qnvector");
     memory->create(isSolid,nmax,"diamondlambda/atom:isSolid");
     memory->create(nucleiID,nmax,"diamondlambda/atom:nucleiID");
+    memory->create(clusterParent,nmax,"diamondlambda/atom:clusterParent");
     if (computeNucleiId) {
         vector_atom = nucleiID;
     }
@@ -303,6 +365,25 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   memory->destroy(NearestNeighNumber);              
   memory->create(NearestNeighNumber,inum,"diamondlambda/atom:NearestNeighNumber");     
   
+  // the loops over atoms use the threads of the OPENMP package
+  // insure distsq and nearest arrays of every thread are long enough
+
+  const int nthreads = comm->nthreads;
+  jnum = 0;
+  for (ii = 0; ii < inum; ii++) jnum = MAX(jnum,numneigh[ilist[ii]]);
+  if (jnum > maxneigh || nthreads > maxthreads) {
+    memory->destroy(distsqO);
+    memory->destroy(distsqH);
+    memory->destroy(nearestO);
+    memory->destroy(nearestH);
+    maxneigh = MAX(jnum,maxneigh);
+    maxthreads = MAX(nthreads,maxthreads);
+    memory->create(distsqO,maxthreads,maxneigh,"diamondlambda/atom:distsqO");
+    memory->create(distsqH,maxthreads,maxneigh,"diamondlambda/atom:distsqH");
+    memory->create(nearestO,maxthreads,maxneigh,"diamondlambda/atom:nearestO");
+    memory->create(nearestH,maxthreads,maxneigh,"diamondlambda/atom:nearestH");
+  }
+
   // compute lambda parameter for each atom in group
   // use full neighbor list to count atoms less than cutoff
 
@@ -310,7 +391,15 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   double **x = atom->x;
   int *mask = atom->mask;
 
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,64) private(i,j,jj,jnum,jlist,xtmp,ytmp,ztmp,delx,dely,delz,rsq)
+#endif
   for (ii = 0; ii < inum; ii++) {
+#if defined(_OPENMP)
+    const int tid = omp_get_thread_num();
+#else
+    const int tid = 0;
+#endif
     i = ilist[ii];
     hydrogenBondNeigh[ii][0]=-1;
     hydrogenBondNeigh_big[ii][0]=-1;
@@ -327,69 +416,41 @@ void ComputeDiamondLambdaAtom::compute_peratom()
       jlist = firstneigh[i];
       //length of neighbour list
       jnum = numneigh[i];
-      
-      // insure distsq and nearest arrays are long enough
-
-      if (jnum > maxneigh) {
-        memory->destroy(distsqO);
-        memory->destroy(distsqH);
-        memory->destroy(nearestO);
-        memory->destroy(nearestH);
-        maxneigh = jnum;
-        memory->create(distsqO,maxneigh,"diamondlambda/atom:distsqO");
-        memory->create(distsqH,maxneigh,"diamondlambda/atom:distsqH");
-        memory->create(nearestO,maxneigh,"diamondlambda/atom:nearestO");
-        memory->create(nearestH,maxneigh,"diamondlambda/atom:nearestH");
-      }
 
-      // loop over list of all neighbors within force cutoff
-      // distsq[] = distance sq to each
-      // nearest[] = atom indices of neighbors
-      // neighbor_big
+      // loop over list of all neighbors within the list cutoff, once
+      // neighbor_big = atom indices within cutoff_big
+      // distsq[] = distance sq to each within cutoff
+      // nearest[] = atom indices of neighbors within cutoff
       int ncountO = 0, ncountH = 0, nHydrongenBoundNeigh=0;
       for (jj = 0; jj < jnum; jj++) {
         j = jlist[jj];
         //make sure j contains the effective information
         j &= NEIGHMASK;
-        if (mask[j] & groupbit) {                       
-                        delx = xtmp - x[j][0];
-                        dely = ytmp - x[j][1];
-                        delz = ztmp - x[j][2];
-
-                        rsq = delx*delx + dely*dely + delz*delz;
-                        if (rsq < cutbig) {
-                            //neighbour list
-       	 			hydrogenBondNeigh_big[ii][nHydrongenBoundNeigh]=j;
-        			nHydrongenBoundNeigh++;
-        			if (nHydrongenBoundNeigh<40) {                  
-            				hydrogenBondNeigh_big[ii][nHydrongenBoundNeigh]=-1;
-                                }
-                        }
-                }
-      }
-
-      ncountO = 0, ncountH = 0;
-      for (jj = 0; jj < jnum; jj++) {
-        j = jlist[jj];
-        j &= NEIGHMASK;
-        if (mask[j] & groupbit) {                       
-			delx = xtmp - x[j][0];
-			dely = ytmp - x[j][1];
-			delz = ztmp - x[j][2];
-
-			rsq = delx*delx + dely*dely + delz*delz;
-			if (rsq < cutsq) {
-                //record the neighbour O atom and H atom distance and index
-				if (oxygenId<0||atom->type[j]==oxygenId) {
-					distsqO[ncountO] = rsq;
-					nearestO[ncountO++] = j;
-				}
-				if (oxygenId>=0&&hydrogenId>=0&&atom->type[j]==hydrogenId) {
-					distsqH[ncountH] = rsq;
-					nearestH[ncountH++] = j;
-				}
-			}
-		}
+        if (!(mask[j] & groupbit)) continue;
+        delx = xtmp - x[j][0];
+        dely = ytmp - x[j][1];
+        delz = ztmp - x[j][2];
+        rsq = delx*delx + dely*dely + delz*delz;
+
+        if (rsq < cutbig) {
+          //neighbour list
+          hydrogenBondNeigh_big[ii][nHydrongenBoundNeigh]=j;
+          nHydrongenBoundNeigh++;
+          if (nHydrongenBoundNeigh<40) {
+            hydrogenBondNeigh_big[ii][nHydrongenBoundNeigh]=-1;
+          }
+        }
+        if (rsq < cutsq) {
+          //record the neighbour O atom and H atom distance and index
+          if (oxygenId<0||atom->type[j]==oxygenId) {
+            distsqO[tid][ncountO] = rsq;
+            nearestO[tid][ncountO++] = j;
+          }
+          if (oxygenId>=0&&hydrogenId>=0&&atom->type[j]==hydrogenId) {
+            distsqH[tid][ncountH] = rsq;
+            nearestH[tid][ncountH++] = j;
+          }
+        }
       }
 
       // use only nearest nnn neighbors
@@ -406,10 +467,10 @@ void ComputeDiamondLambdaAtom::compute_peratom()
       
       nHydrongenBoundNeigh=0;
       for (jj = 0; jj < ncountO; jj++) {
-        j = nearestO[jj];
+        j = nearestO[tid][jj];
         j &= NEIGHMASK;
 
-        if (!hydrogenBond(i,j,ncountH)) {
+        if (!hydrogenBond(i,j,nearestH[tid],ncountH)) {
             continue;
         }
         //store the hydrogenbound information
@@ -423,42 +484,48 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   }
 
 
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,64) private(i,j,jj,xtmp,ytmp,ztmp,delx,dely,delz)
+#endif
   for (ii = 0; ii < inum; ii++) {
       i = ilist[ii];
       xtmp = x[i][0];
       ytmp = x[i][1];
       ztmp = x[i][2];
-      //an array used for store the value of Spherical Harmonics with real part and complex part, an array like q_l = [ql,-l_real, ql, -l_complex, ql,-l+1_real....ql,l_complex]
+      //the values of the Spherical Harmonics, the real parts q_l,-l ... q_l,l followed by the imaginary parts
       double *qlm= qlmarray[i];
 
       for (int m=0;m<2*ndegree+1;m++) {
-          qlm[m*2]=0;
-          qlm[m*2+1]=0;
-          double sWeight=0;
+          qlm[m]=0;
+          qlm[qlmStride+m]=0;
+      }
+      double sWeight=0;
 
-          for (jj = 0; jj < 20; jj++) {     
-              j = hydrogenBondNeigh[ii][jj];
-              if (j==-1) {
-                  break;
-              }
-              delx = xtmp - x[j][0];
-              dely = ytmp - x[j][1];
-              delz = ztmp - x[j][2];
-              double r=sqrt(delx*delx+dely*dely+delz*delz);
-              double rinv = 1.0/r;
-              //adjust the weight according to rsoft
-              double weight=smearing(r);
-              delx*=rinv;
-              dely*=rinv;
-              delz*=rinv;
-              //add the real part and the complex part into the array
-              add_qlm_complex(m-ndegree,weight,delx,dely,delz,qlm+m*2,qlm+m*2+1);
-              sWeight+=weight;
+      //all m of a bond are added in one pass
+      for (jj = 0; jj < 20; jj++) {
+          j = hydrogenBondNeigh[ii][jj];
+          if (j==-1) {
+              break;
           }
-          //factor of 1/N_i(b)
-          if (sWeight>0) {
-              qlm[m*2]/=sWeight;
-              qlm[m*2+1]/=sWeight;
+          delx = xtmp - x[j][0];
+          dely = ytmp - x[j][1];
+          delz = ztmp - x[j][2];
+          double r=sqrt(delx*delx+dely*dely+delz*delz);
+          double rinv = 1.0/r;
+          //adjust the weight according to rsoft
+          double weight=smearing(r);
+          delx*=rinv;
+          dely*=rinv;
+          delz*=rinv;
+          //add the real part and the complex part into the array
+          (this->*addQlm)(weight,delx,dely,delz,qlm);
+          sWeight+=weight;
+      }
+      //factor of 1/N_i(b)
+      if (sWeight>0) {
+          for (int m=0;m<2*ndegree+1;m++) {
+              qlm[m]/=sWeight;
+              qlm[qlmStride+m]/=sWeight;
           }
       }
   }
@@ -466,13 +533,23 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   packSolid=false;
   packNuclei=false;
   comm->forward_comm(this);
+  //the norms are used by every bond, so they are found once per atom
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+#endif
+  for (i = 0; i < atom->nlocal + atom->nghost; i++) {
+      const double *re=qlmarray[i], *im=qlmarray[i]+qlmStride;
+      double norm=0;
+      for (int m=0;m<qlmStride;m++) {
+          norm+=re[m]*re[m]+im[m]*im[m];
+      }
+      qlnorm[i]=sqrt(norm);
+  }
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,64) private(i,j,jj)
+#endif
   for (ii = 0; ii < inum; ii++) {
     i = ilist[ii];
-      xtmp = x[i][0];
-      ytmp = x[i][1];
-      ztmp = x[i][2];
-      jlist = firstneigh[i];
-      
 
       // loop over list of all neighbors within force cutoff
       // distsq[] = distance sq to each
@@ -490,7 +567,7 @@ void ComputeDiamondLambdaAtom::compute_peratom()
           double dely=atom->x[j][1]-atom->x[i][1];
           double delz=atom->x[j][2]-atom->x[i][2];
           double weight=smearing(sqrt(delx*delx+dely*dely+delz*delz));
-          add_qn_complex(i, j, weight, &usum, &vsum);
+          (this->*addQn)(i, j, weight, &usum, &vsum);
           sWeight+=weight;
       }
       if (sWeight>0) {
@@ -502,10 +579,16 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   if (!computeNucleiId) {
       return ;
   }
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+#endif
   for (int i = atom->nmax - 1; i >= 0; i -= 1) {
     isSolid[i] = 0;
     nucleiID[i] = 0;
   }
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,64) private(i)
+#endif
   for (ii = 0; ii < inum; ii++) {
     i = ilist[ii];
     if ((mask[i] & groupbit)) {
@@ -527,60 +610,114 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   packNuclei=true;
   comm->forward_comm(this);
 
-  int change,done,anychange;
+  // clusters of solid atoms closer than cutoff_big take the lowest tag in them
+  // local atoms and their ghosts are joined first by union-find,
+  // the root of a tree is the atom with the lowest label
 
-  while (1) {
-      change = 0;
-      while (1) {
-          done = 1;
-          for (ii = 0; ii < inum; ii++) {
-              i = ilist[ii];
-              if (!(mask[i] & groupbit)) continue;
-              if (isSolid[i] != 1) {
-                  continue;
-              }
-              //here i atom is solid
-
-              xtmp = x[i][0];
-              ytmp = x[i][1];
-              ztmp = x[i][2];
-              for (jj = 0; jj < 40; jj++) {     
-                  j = hydrogenBondNeigh_big[ii][jj];
-                  //j = ilist[jj];
-                  if (j==-1) {
-                      break;
-                  }
-                  if (nucleiID[i] == nucleiID[j]) {
-                      continue;
-                  }
-                  if (isSolid[j] != 1) {
-                      continue;
-                  }
-                    //j atom is solid and nucleiID is not same with i atom
-                  delx = xtmp - x[j][0];
-                  dely = ytmp - x[j][1];
-                  delz = ztmp - x[j][2];
-                  rsq = delx*delx + dely*dely + delz*delz;
-                  if (rsq < cutbig) {
-                      int iMin = MIN(nucleiID[i],nucleiID[j]);
-                      nucleiID[i] = nucleiID[j] = iMin;
-                      done = 0;
-                  }
-              }
+  const int nall = atom->nlocal + atom->nghost;
+  for (i = 0; i < nall; i++) clusterParent[i] = i;
+  for (ii = 0; ii < inum; ii++) {
+      i = ilist[ii];
+      if (!(mask[i] & groupbit)) continue;
+      if (isSolid[i] != 1) {
+          continue;
+      }
+      xtmp = x[i][0];
+      ytmp = x[i][1];
+      ztmp = x[i][2];
+      for (jj = 0; jj < 40; jj++) {
+          j = hydrogenBondNeigh_big[ii][jj];
+          if (j==-1) {
+              break;
+          }
+          if (isSolid[j] != 1) {
+              continue;
+          }
+          delx = xtmp - x[j][0];
+          dely = ytmp - x[j][1];
+          delz = ztmp - x[j][2];
+          rsq = delx*delx + dely*dely + delz*delz;
+          if (rsq < cutbig) {
+              const int ri = cluster_root(i), rj = cluster_root(j);
+              if (ri == rj) continue;
+              if (nucleiID[ri] < nucleiID[rj]) clusterParent[rj] = ri;
+              else clusterParent[ri] = rj;
+          }
+      }
+  }
+  for (ii = 0; ii < inum; ii++) {
+      i = ilist[ii];
+      if ((mask[i] & groupbit) && isSolid[i] == 1) nucleiID[i] = nucleiID[cluster_root(i)];
+  }
+
+  // the ghosts get the labels their owners found, a cluster crossing
+  // subdomains leaves pairs of labels of the same cluster, which are
+  // gathered and joined on every proc at once
+
+  comm->forward_comm(this);
+  std::set<std::pair<tagint,tagint> > pairs;
+  for (ii = 0; ii < inum; ii++) {
+      i = ilist[ii];
+      if (!(mask[i] & groupbit)) continue;
+      if (isSolid[i] != 1) {
+          continue;
+      }
+      for (jj = 0; jj < 40; jj++) {
+          j = hydrogenBondNeigh_big[ii][jj];
+          if (j==-1) {
+              break;
+          }
+          if (j < atom->nlocal || isSolid[j] != 1 || nucleiID[i] == nucleiID[j]) {
+              continue;
+          }
+          delx = x[i][0] - x[j][0];
+          dely = x[i][1] - x[j][1];
+          delz = x[i][2] - x[j][2];
+          rsq = delx*delx + dely*dely + delz*delz;
+          if (rsq < cutbig) {
+              pairs.insert(std::make_pair((tagint) nucleiID[i],(tagint) nucleiID[j]));
           }
-          if (!done) change = 1;
-          //if there is no j to handle, break
-          if (done) break;
       }
-      MPI_Allreduce(&change,&anychange,1,MPI_INT,MPI_MAX,world);
-      //if there's no change, break
-      if (!anychange) break;
-      packQlm=false;
-      packSolid=false;
-      packNuclei=true;
+  }
+
+  std::vector<tagint> mine;
+  for (std::set<std::pair<tagint,tagint> >::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+      mine.push_back(it->first);
+      mine.push_back(it->second);
+  }
+  int nmine = mine.size();
+  std::vector<int> counts(comm->nprocs), displs(comm->nprocs);
+  MPI_Allgather(&nmine,1,MPI_INT,&counts[0],1,MPI_INT,world);
+  int ntotal = 0;
+  for (int p = 0; p < comm->nprocs; p++) {
+      displs[p] = ntotal;
+      ntotal += counts[p];
+  }
+  if (ntotal > 0) {
+      std::vector<tagint> all(ntotal);
+      MPI_Allgatherv(mine.empty() ? NULL : &mine[0],nmine,MPI_LMP_TAGINT,
+                     &all[0],&counts[0],&displs[0],MPI_LMP_TAGINT,world);
+      std::map<tagint,tagint> labelParent;
+      for (int k = 0; k < ntotal; k++) labelParent[all[k]] = all[k];
+      for (int k = 0; k < ntotal; k += 2) {
+          const tagint a = label_root(labelParent,all[k]);
+          const tagint b = label_root(labelParent,all[k+1]);
+          if (a < b) labelParent[b] = a;
+          else if (b < a) labelParent[a] = b;
+      }
+      for (ii = 0; ii < inum; ii++) {
+          i = ilist[ii];
+          if (!(mask[i] & groupbit) || isSolid[i] != 1) continue;
+          if (labelParent.count((tagint) nucleiID[i]))
+              nucleiID[i] = label_root(labelParent,(tagint) nucleiID[i]);
+      }
       comm->forward_comm(this);
   }
   if (biggest) {
+      // only the labels of liquid atoms change, solid ones are read
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,64) private(i,j,jj,xtmp,ytmp,ztmp,delx,dely,delz,rsq)
+#endif
       for (ii = 0; ii < inum; ii++) {
           i = ilist[ii];
           if (!(mask[i] & groupbit)) continue;
@@ -599,11 +736,11 @@ void ComputeDiamondLambdaAtom::compute_peratom()
               if (j==-1) {
                   break;
               }
-              if (nucleiID[i] == nucleiID[j]) {
-                continue;
-              }
               if (isSolid[j] != 1) {
                   continue;
+              }
+              if (nucleiID[i] == nucleiID[j]) {
+                continue;
               }
                 //now j atom is solid and nucleiID != i
               delx = xtmp - x[j][0];
@@ -622,35 +759,57 @@ void ComputeDiamondLambdaAtom::compute_peratom()
   }
 }
 
-void ComputeDiamondLambdaAtom::add_qlm_complex(int m,double frr,double x,double y,double z,double *u,double *v) {
-    double f=frr*polar_prefactor(ndegree,m,z);
-    double phi=atan2(y,x);
-    phi*=m;
-    *u += f*cos(phi);
-    *v += f*sin(phi);
+/* ----------------------------------------------------------------------
+   add frr*Y_l^m of the unit vector (x,y,z) for all m in one pass, with
+   Y_l^m = ylmnorm[m] * P_l^m(z)/sin^m(theta) * (x+iy)^m
+   P_l^m/sin^m is a polynomial in z, found by the recurrence in l from
+   P_m^m/sin^m = (2m-1)!!, and Y_l^-m = (-1)^m conj(Y_l^m)
+------------------------------------------------------------------------- */
+
+template<int L>
+void ComputeDiamondLambdaAtom::add_qlm_all(double frr,double x,double y,double z,double *qlm) {
+    const int l=L<0 ? ndegree : L;
+    const int stride=L<0 ? qlmStride : QLM_STRIDE(2*L+1);
+    double *re=qlm+l, *im=qlm+stride+l;   // m=0 is in the middle
+    double pmm=1.0;          // (2m-1)!!
+    double cr=1.0,ci=0.0;    // (x+iy)^m
+    for (int m=0;m<=l;m++) {
+        double p=pmm,pm1=0.0;
+        for (int i=m+1;i<=l;i++) {
+            const double pm2=pm1;
+            pm1=p;
+            p=(static_cast<double>(2*i-1)*z*pm1
+               - static_cast<double>(i+m-1)*pm2) / static_cast<double>(i-m);
+        }
+        const double f=frr*ylmnorm[m]*p;
+        re[m]+=f*cr;
+        im[m]+=f*ci;
+        if (m>0) {
+            const double sign=(m%2) ? -1.0 : 1.0;
+            re[-m]+=sign*f*cr;
+            im[-m]-=sign*f*ci;
+        }
+        pmm*=static_cast<double>(2*m+1);
+        const double t=cr*x-ci*y;
+        ci=cr*y+ci*x;
+        cr=t;
+    }
 }
 
-// calculate lambda parameter using std::complex::pow function
+// calculate lambda parameter as q_l(i).q_l(j)*/(|q_l(i)||q_l(j)|)
 //lambda value is the real part, here the lambda is lack of a prefactor of 1/N
-//do inner product of two vector
-inline void ComputeDiamondLambdaAtom::add_qn_complex(int i,int j,double frr, double *u, double *v) {
+//the padding is zero, so the loops run over whole vectors
+template<int L>
+void ComputeDiamondLambdaAtom::add_qn_complex(int i,int j,double frr, double *u, double *v) {
+    const int stride=L<0 ? qlmStride : QLM_STRIDE(2*L+1);
+    const double *reI=qlmarray[i], *imI=qlmarray[i]+stride;
+    const double *reJ=qlmarray[j], *imJ=qlmarray[j]+stride;
     double x=0,y=0;
-    double normI=0,normJ=0;
-    int m;
-    for (m=0;m<2*ndegree+1;m++) {
-        //x is real part, y is complex part, n is norm
-        double xI=qlmarray[i][m*2],yI=qlmarray[i][m*2+1];
-        double xJ=qlmarray[j][m*2],yJ=-qlmarray[j][m*2+1];
-        double xD=xI*xJ-yI*yJ;
-        double yD=xI*yJ+xJ*yI;
-        double nID=xI*xI+yI*yI;
-        double nJD=xJ*xJ+yJ*yJ;
-        x+=xD;
-        y+=yD;
-        normI+=nID;
-        normJ+=nJD;
+    for (int m=0;m<stride;m++) {
+        x+=reI[m]*reJ[m]+imI[m]*imJ[m];
+        y+=imI[m]*reJ[m]-reI[m]*imJ[m];
     }
-    double normIJ=sqrt(normI*normJ);
+    double normIJ=qlnorm[i]*qlnorm[j];
     if (normIJ>0) {
         *u+=x/normIJ*frr;
         *v+=y/normIJ*frr;
@@ -729,59 +888,38 @@ void ComputeDiamondLambdaAtom::select2(int k, int n, double *arr, int *iarr)
 double ComputeDiamondLambdaAtom::memory_usage()
 {
   double bytes = nmax * sizeof(double);
-  bytes += maxneigh * sizeof(double); 
-  bytes += maxneigh * sizeof(int); 
+  bytes += maxthreads * maxneigh * 2 * sizeof(double);
+  bytes += maxthreads * maxneigh * 2 * sizeof(int);
 
   return bytes;
 }
 
 /* ----------------------------------------------------------------------
-   polar prefactor for spherical harmonic Y_l^m, where 
-   Y_l^m (theta, phi) = prefactor(l, m, cos(theta)) * exp(i*m*phi)
+   root of the cluster tree of atom i, halving the path on the way
 ------------------------------------------------------------------------- */
 
-double ComputeDiamondLambdaAtom::
-polar_prefactor(int l, int m, double costheta) {
-  const int mabs = abs(m);
-
-  double prefactor = 1.0;
-  for (int i=l-mabs+1; i < l+mabs+1; ++i)
-    prefactor *= static_cast<double>(i);
-
-  prefactor = sqrt(static_cast<double>(2*l+1)/(MY_4PI*prefactor))
-    * associated_legendre(l,mabs,costheta);
-
-  if ((m < 0) && (m % 2)) prefactor = -prefactor;
-  //if (mabs%2) prefactor=-prefactor;
-
-  return prefactor;
+int ComputeDiamondLambdaAtom::cluster_root(int i)
+{
+  while (clusterParent[i] != i) {
+    clusterParent[i] = clusterParent[clusterParent[i]];
+    i = clusterParent[i];
+  }
+  return i;
 }
 
 /* ----------------------------------------------------------------------
-   associated legendre polynomial
+   lowest label of the cluster that label a belongs to
 ------------------------------------------------------------------------- */
 
-double ComputeDiamondLambdaAtom::
-associated_legendre(int l, int m, double x) {
-  if (l < m) return 0.0;
-
-  double p(1.0), pm1(0.0), pm2(0.0);
-
-  if (m != 0) {
-    const double sqx = sqrt(1.0-x*x);
-    for (int i=1; i < m+1; ++i)
-      p *= static_cast<double>(2*i-1) * sqx;
-  }
-
-  for (int i=m+1; i < l+1; ++i) {
-    pm2 = pm1;
-    pm1 = p;
-    p = (static_cast<double>(2*i-1)*x*pm1
-         - static_cast<double>(i+m-1)*pm2) / static_cast<double>(i-m);
+tagint ComputeDiamondLambdaAtom::label_root(std::map<tagint,tagint> &parent, tagint a)
+{
+  while (parent[a] != a) {
+    parent[a] = parent[parent[a]];
+    a = parent[a];
   }
-
-  return p;
+  return a;
 }
+
 double ComputeDiamondLambdaAtom::smearing(double r) const {
     if (rsoft==0) {
         return 1;
@@ -796,7 +934,7 @@ inline double dis(double x1,double y1,double z1,double x2,double y2,double z2) {
 }
 
 //check if there's hydrogenBond between i and j atom
-bool ComputeDiamondLambdaAtom::hydrogenBond(int i,int j,int ncountH) const {
+bool ComputeDiamondLambdaAtom::hydrogenBond(int i,int j,const int *nearestH,int ncountH) const {
     if (hydroDev<0||hydrogenId<0) {
         return true;
     }
@@ -21,6 +21,7 @@ ComputeStyle(diamondlambda/atom,ComputeDiamondLambdaAtom)
 #define LMP_COMPUTE_DIAMONDLAMBDA_ATOM_H
 
 #include "compute.h"
+#include <map>
 
 namespace LAMMPS_NS {
 
@@ -36,14 +37,14 @@ class ComputeDiamondLambdaAtom : public Compute {
   void unpack_forward_comm(int, int, double *);
 
  private:
-  int nmax,maxneigh,nnn,ndegree; 
+  int nmax,maxneigh,maxthreads,nnn,ndegree; 
   double cutsq,rsoft,cutbig;
   class NeighList *list;
   int **hydrogenBondNeigh_big;
   int **hydrogenBondNeigh;
   int *NearestNeighNumber;     //gn
-  double *distsqO,*distsqH;
-  int *nearestO,*nearestH;
+  double **distsqO,**distsqH;   // scratch of each thread
+  int **nearestO,**nearestH;
   int hydrogenId,oxygenId;
   double hydroDev;
   bool packQlm,packSolid,packNuclei;
@@ -56,21 +57,31 @@ class ComputeDiamondLambdaAtom : public Compute {
   double hardNeighbourDistance;
   int hardNeighbourCount;
 
+  // per atom the real parts of q_lm for m=-l..l, then the imaginary parts,
+  // each padded with zeros to qlmStride values
   double **qlmarray;
+  int qlmStride;
+  double *qlnorm;              // |q_l| of each atom
   double *qnvector;
   double *nucleiID;
   double *isSolid;
-
-  void add_qlm_complex(int m,double frr,double normx,double normy,double normz,double *u,double *v);
-  void add_qn_complex(int, int, double, double*, double*);
+  int *clusterParent;          // union-find tree of the solid atoms
+  double *ylmnorm;             // normalization of Y_l^m for m=0..l
+
+  // kernels for a fixed degree L, or for ndegree when L<0,
+  // the one for ndegree is picked in the constructor
+  template<int L> void add_qlm_all(double frr,double normx,double normy,double normz,double *qlm);
+  template<int L> void add_qn_complex(int, int, double, double*, double*);
+  void (ComputeDiamondLambdaAtom::*addQlm)(double,double,double,double,double*);
+  void (ComputeDiamondLambdaAtom::*addQn)(int, int, double, double*, double*);
   void calc_qn_trig(double, double, double&, double&);
   void select2(int, int, double *, int *);
 
-  double polar_prefactor(int, int, double);
-  double associated_legendre(int, int, double);
   double smearing(double) const;
+  int cluster_root(int);
+  static tagint label_root(std::map<tagint,tagint> &, tagint);
 
-  bool hydrogenBond(int i,int j,int ncountH) const;
+  bool hydrogenBond(int i,int j,const int *nearestH,int ncountH) const;
   bool checkSolid(int ii) const;
 };
 
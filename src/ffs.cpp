@@ -1,17 +1,29 @@
 #include<unistd.h>
+#include<sys/stat.h>
 #include<stdarg.h>
 #include<stdio.h>
 #include<string.h>
 #include<mpi.h>
 #include<cstdlib>
+#include<algorithm>
 #include<ctime>
+#include<csignal>
 #include<map>
+#include<deque>
+#include<list>
 #include<queue>
 #include<string>
+#include<thread>
 #include"lammps.h"
 #include"library.h"
 #include"input.h"
 #include"update.h"
+#include"modify.h"
+#include"domain.h"
+#include"atom.h"
+#include"comm.h"
+#include"irregular.h"
+#include"fix_ffs_interface.h"
 #include"ffs.h"
 using namespace LAMMPS_NS;
 #define DEBUG printf("------ rank %d (%d of universe %d) ------ line %d ------\n", world->rank, local->rank, local->id, __LINE__);
@@ -38,8 +50,9 @@ class FfsBranch {
 public:
     FfsBranch() {
       if (!FfsBranch::commInited) {
-        //it's equal to the shooting number
-        size = world->size / local->size;
+        //it's equal to the shooting number, the universes may have different sizes
+        int leader=local->isLeader;
+        MPI_Allreduce(&leader, &size, 1, MPI_INT, MPI_SUM, world->comm);
         FfsBranch::initComm();
         FfsBranch::commInited=true;
       }
@@ -50,64 +63,138 @@ private:
     static bool commInited;
     static void initComm() {
         MPI_Comm_dup(local->comm, &FfsBranch::commLocal);
+        //FfsLocalFlag keeps a nonblocking broadcast in flight, it gets its own communicator
+        MPI_Comm_dup(local->comm, &FfsBranch::commFlag);
         //split the leader process from local, and assign it to the commLeader
         MPI_Comm_split(world->comm, local->isLeader ? 0 : MPI_UNDEFINED, world->rank, &FfsBranch::commLeader);
     };
 protected:
     static int size;
-    static MPI_Comm commLeader,commLocal;
+    static MPI_Comm commLeader,commLocal,commFlag;
     static const int TAG_COUNTDOWN_DONE=1;
-    static const int TAG_COUNTDOWN_TERMINATE=2;
     static const int TAG_FILEWRITER_LINE=3;
-    static const int TAG_FILEREADER=5;
     static const int TAG_STATS_FLUSH=6;
+    static const int TAG_PIPELINE_REQUEST=7;
+    static const int TAG_PIPELINE_WORK=8;
 };
 bool FfsBranch::commInited=false;
 //construct 2 communicator, commLeader contains the leader process, 
-MPI_Comm FfsBranch::commLeader,FfsBranch::commLocal;
+MPI_Comm FfsBranch::commLeader,FfsBranch::commLocal,FfsBranch::commFlag;
 //it's equal to the cpuEach
 int FfsBranch::size=0;
+//a receive that is posted once and restarted after every message, so the owner only tests a local request instead of probing
+class FfsPersistentRecv {
+public:
+    FfsPersistentRecv(void *buffer,int count,MPI_Datatype type,int source,int tag,MPI_Comm comm) {
+        MPI_Recv_init(buffer, count, type, source, tag, comm, &request);
+        MPI_Start(&request);
+        ready=false;
+    }
+    ~FfsPersistentRecv() {
+        if (!ready) {
+            //nobody will send to it anymore, withdraw the posted receive
+            MPI_Cancel(&request);
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+        }
+        MPI_Request_free(&request);
+    }
+
+    //check if a message arrived, restart() must be called once the buffer is consumed
+    bool test(MPI_Status *status) {
+        if (!ready) {
+            int flag;
+            MPI_Test(&request, &flag, &lastStatus);
+            ready=flag;
+        }
+        if (ready&&status) {
+            *status=lastStatus;
+        }
+        return ready;
+    }
+    void restart() {
+        ready=false;
+        MPI_Start(&request);
+    }
+
+    //block until one of the n receives gets a message, null entries are skipped
+    static void waitAny(int n,FfsPersistentRecv **recvs) {
+        std::vector<MPI_Request> requests;
+        std::vector<FfsPersistentRecv *> owners;
+        for (int i=0;i<n;i++) {
+            if (recvs[i]==0) {
+                continue;
+            }
+            if (recvs[i]->ready) {
+                return ;
+            }
+            requests.push_back(recvs[i]->request);
+            owners.push_back(recvs[i]);
+        }
+        if (requests.empty()) {
+            return ;
+        }
+        int index;
+        MPI_Status status;
+        MPI_Waitany(requests.size(), &requests[0], &index, &status);
+        //persistent requests stay allocated, only the owner needs to know the message is there
+        owners[index]->ready=true;
+        owners[index]->lastStatus=status;
+    }
+private:
+    MPI_Request request;
+    MPI_Status lastStatus;
+    bool ready;
+};
 struct FfsFileReader: public FfsBranch {
     std::map<std::string,std::string> dict;
     //Initialization function, with input parameter "filename" in char pointer type. It can construct a dictionary with "key" refers to the command, and "value" refers to the parameter
     FfsFileReader(const char *filename) {
         //only the world leader process read file
         if (world->isLeader) {
-            FILE *f=fopen(filename,"r");
-            static char cLine[1024];
-            while (fgets(cLine,sizeof(cLine),f)) {
-                std::string sLine(cLine);
-                int l=sLine.find_first_of('#');
-                //check if "#" exist. If true, substract the substring for the beginning to the "#" such as "command    parameter   #comment"
-                if (l!=std::string::npos) {
-                    sLine=sLine.substr(0,l);
-                }
-                const std::string SPACE=" \t\n\v\f\r";
-                int begin1=sLine.find_first_not_of(SPACE);
-                //delete the white space characters
-                if (begin1==std::string::npos) {
-                    continue;
-                }
-                int end1=sLine.find_first_of(SPACE,begin1);
-                //find the end of command, substract the command, like "command parameter"
-                if (end1==std::string::npos) {
-                    end1=sLine.length();
-                }
-                std::string key=sLine.substr(begin1,end1-begin1);
-                dict[key]="";
-                //substract the parameter
-                int begin2=sLine.find_first_not_of(SPACE,end1);
-                if (begin2==std::string::npos) {
-                    continue;
-                }
-                int end2=sLine.find_last_not_of(SPACE)+1;
-                std::string value=sLine.substr(begin2,end2-begin2);
-                dict[key]=value;
-            }
-            fclose(f);
+            read(filename,&dict);
         }
     };
 
+    //the "key value" lines of the file, without MPI, false when it cannot be opened
+    static bool read(const char *filename, std::map<std::string,std::string> *dict) {
+        FILE *f=fopen(filename,"r");
+        if (!f) {
+            return false;
+        }
+        static char cLine[1024];
+        while (fgets(cLine,sizeof(cLine),f)) {
+            std::string sLine(cLine);
+            int l=sLine.find_first_of('#');
+            //check if "#" exist. If true, substract the substring for the beginning to the "#" such as "command    parameter   #comment"
+            if (l!=std::string::npos) {
+                sLine=sLine.substr(0,l);
+            }
+            const std::string SPACE=" \t\n\v\f\r";
+            int begin1=sLine.find_first_not_of(SPACE);
+            //delete the white space characters
+            if (begin1==std::string::npos) {
+                continue;
+            }
+            int end1=sLine.find_first_of(SPACE,begin1);
+            //find the end of command, substract the command, like "command parameter"
+            if (end1==std::string::npos) {
+                end1=sLine.length();
+            }
+            std::string key=sLine.substr(begin1,end1-begin1);
+            (*dict)[key]="";
+            //substract the parameter
+            int begin2=sLine.find_first_not_of(SPACE,end1);
+            if (begin2==std::string::npos) {
+                continue;
+            }
+            int end2=sLine.find_last_not_of(SPACE)+1;
+            std::string value=sLine.substr(begin2,end2-begin2);
+            (*dict)[key]=value;
+        }
+        fclose(f);
+        return true;
+    }
+
     //Parses a command string "parameter" into a int value
     int getInt(const std::string &name) const {
         int y=0;
@@ -116,6 +203,24 @@ struct FfsFileReader: public FfsBranch {
         return y;
     }
 
+    //same as getInt, but the parameter is optional and falls back to defaultValue when missing
+    int getInt(const std::string &name, int defaultValue) const {
+        if (!has(name)) {
+            return defaultValue;
+        }
+        return getInt(name);
+    }
+
+    //check if the parameter exists in the ffs input, the result is shared by all process
+    bool has(const std::string &name) const {
+        int found=0;
+        if (world->isLeader) {
+            found=dict.find(name)!=dict.end();
+        }
+        MPI_Bcast(&found, 1, MPI_INT, 0, world->comm);
+        return found;
+    }
+
     //Parses a command string "<param1, param2, ...>" into a vector of parameters
     std::vector<int> getVector(const std::string &name) const {
         std::vector<int> v;
@@ -138,7 +243,7 @@ struct FfsFileReader: public FfsBranch {
             std::map<std::string,std::string>::const_iterator i=dict.find(name);
             if (i==dict.end()) {
               fprintf(stderr, "Missing parameter \"%s\" in ffs input\n", name.c_str());
-              p = NULL;
+              p = new char[1];
               l = 0;
             }
             else {
@@ -159,23 +264,86 @@ struct FfsFileReader: public FfsBranch {
         delete[] p;
         return result;
     }
+
+    //same as getString, but the parameter is optional and falls back to defaultValue when missing
+    const std::string getString(const std::string &name, const std::string &defaultValue) const {
+        if (!has(name)) {
+            return defaultValue;
+        }
+        return getString(name);
+    }
 };
 const FfsFileReader *ffsParams;
+//counters kept by the world leader that any local leader can increase atomically, without the world leader taking part
+class FfsAtomicCounter: public FfsBranch {
+public:
+    //called by all local leaders
+    FfsAtomicCounter(int n,const int64_t *init=0):n(n) {
+        values=new int64_t[n];
+        for (int i=0;i<n;i++) {
+            values[i]=init ? init[i] : 0;
+        }
+        MPI_Win_create(values, world->isLeader ? n*sizeof(int64_t) : 0, sizeof(int64_t), MPI_INFO_NULL, FfsBranch::commLeader, &window);
+    }
+    ~FfsAtomicCounter() {
+        MPI_Win_free(&window);
+        delete[] values;
+    }
+    //add x to the i-th counter, and return the value before
+    int64_t add(int i,int64_t x) {
+        int64_t old;
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, window);
+        MPI_Fetch_and_op(&x, &old, MPI_LONG_LONG, 0, i, MPI_SUM, window);
+        MPI_Win_unlock(0, window);
+        return old;
+    }
+    int64_t get(int i) {
+        return add(i,0);
+    }
+private:
+    int n;
+    int64_t *values;
+    MPI_Win window;
+};
+
 class FfsFileWriter: public FfsBranch {
 protected:
     FfsFileWriter(const char *filename) {
+        lineRecv=0;
         if (world->isLeader) {
             f=fopen(filename,"w");
+            if (FfsBranch::size>1) {
+                lineRecv=new FfsPersistentRecv(lineBuffer, MAX_LENGTH, MPI_CHAR, MPI_ANY_SOURCE, FfsBranch::TAG_FILEWRITER_LINE, FfsBranch::commLeader);
+            }
         }
         nFlush=0;
+        nSent=0;
+        nReceived=0;
     }
     ~FfsFileWriter() {
         check();
+        if (local->isLeader) {
+            //lines sent after the last countdown are still on the way, wait for all of them
+            int total=0;
+            MPI_Reduce(&nSent, &total, 1, MPI_INT, MPI_SUM, 0, FfsBranch::commLeader);
+            if (world->isLeader) {
+                while (nReceived<total) {
+                    FfsPersistentRecv::waitAny(1,&lineRecv);
+                    check();
+                }
+            }
+        }
         if (world->isLeader) {
+            delete lineRecv;
             fclose(f);
         }
     }
 
+    //the receive of lines, the dedicated coordinator blocks on it
+    FfsPersistentRecv *event() {
+        return lineRecv;
+    }
+
     //receive a series of string, and write it into file
     void writeln(const char *format,...) {
         if (!local->isLeader) {
@@ -197,24 +365,16 @@ protected:
         if (!world->isLeader) {
             return ;
         }
-        static char buffer[MAX_LENGTH];
-        //continuosly receive the broadcast from the process which is not the main process, and then write it into file
-        while (1) {
-            int flag;
-            MPI_Status status;
-            MPI_Iprobe(MPI_ANY_SOURCE, FfsBranch::TAG_FILEWRITER_LINE, FfsBranch::commLeader, &flag, &status);
-            if (flag) {
-                int l;
-                MPI_Get_count(&status,MPI_CHAR,&l);
-                printf("[date=%d] world leader will receive TAG_FILEWRITER_LINE from %d\n", std::time(0), status.MPI_SOURCE);
-                //receive the information and store it in the buffer
-                MPI_Recv(buffer, l, MPI_CHAR, status.MPI_SOURCE, status.MPI_TAG, FfsBranch::commLeader, &status);
-                printf("[date=%d] world leader did receive TAG_FILEWRITER_LINE from %d\n", std::time(0), status.MPI_SOURCE);
-                putstr0(status.MPI_SOURCE,buffer);
-            }
-            else {
-                break;
-            }
+        if (!lineRecv) {
+            return ;
+        }
+        //write every line that has already arrived from the process which is not the main process
+        MPI_Status status;
+        while (lineRecv->test(&status)) {
+            printf("[date=%d] world leader did receive TAG_FILEWRITER_LINE from %d\n", std::time(0), status.MPI_SOURCE);
+            putstr0(status.MPI_SOURCE,lineBuffer);
+            nReceived++;
+            lineRecv->restart();
         }
     }
 
@@ -224,6 +384,9 @@ protected:
     }
 private:
     FILE *f;
+    FfsPersistentRecv *lineRecv;
+    //the number of lines sent to and received by the world leader
+    int nSent,nReceived;
     //if the process is not main process, the function will send the char s to the main process
     void putstr(char *s) {
         s[MAX_LENGTH-1]='\0';
@@ -236,6 +399,7 @@ private:
             printf("[date=%d] universe %d will send TAG_FILEWRITER_LINE\n", std::time(0), local->id);
             //send the value
             MPI_Send(s, l + 1, MPI_CHAR, 0, FfsBranch::TAG_FILEWRITER_LINE, FfsBranch::commLeader);
+            nSent++;
             printf("[date=%d] universe %d did send TAG_FILEWRITER_LINE\n", std::time(0), local->id);
         }
     }
@@ -255,6 +419,7 @@ private:
         }
     }
     static const int MAX_LENGTH=100;
+    char lineBuffer[MAX_LENGTH];
 };
 class FfsLambdaLogger: public FfsFileWriter {
 public:
@@ -277,13 +442,196 @@ public:
         FfsFileWriter::writeln("END %s",xyzFinal);
     }
 };
+//the counters of the random numbers of the universe, set by FfsRandomGenerator, every journal record keeps them
+const uint64_t *randomDrawn=0;
+//
+//counter-based random numbers (Philox4x32-10): a value only depends on the campaign seed, the universe, the purpose
+//and how many values of that purpose the universe has drawn, so all process of a universe get the same values
+//without communication, and a run with the same seed draws the same trials
+class FfsRandomGenerator: public FfsBranch {
+    public:
+        //what the value is used for, each purpose has its own sequence
+        enum Purpose {VELOCITY, PARENT, COORDINATOR, PURPOSES};
+        //the seed is the "seed" line of the ffs input, or the time on the world leader, called by all process
+        FfsRandomGenerator() {
+            int x=ffsParams->getInt("seed",0);
+            if (x==0&&world->isLeader) {
+                x=std::time(0);
+            }
+            MPI_Bcast(&x, 1, MPI_INT, 0, world->comm);
+            seed=x;
+            if (world->isLeader) {
+                printf("[date=%d] random seed %u\n", std::time(0), seed);
+            }
+            for (int i=0;i<PURPOSES;i++) {
+                drawn[i]=0;
+            }
+            restart=0;
+            randomDrawn=drawn;
+            //only the sampling of the status lines still uses std::rand
+            std::srand(seed + world->rank * 1234567);
+        }
+        //the next value of the purpose for this universe, in [1, 2^31-1]
+        int get(Purpose purpose) {
+            return value((uint32_t)local->id, purpose, drawn[purpose]++);
+        }
+        //the next value of the purpose in [0, n), all equally likely: the values of the last incomplete block of n are drawn again
+        int below(Purpose purpose, int n) {
+            const uint32_t limit=0x7fffffff-0x7fffffff%(uint32_t)n;
+            while (1) {
+                const uint32_t x=get(purpose)-1;
+                if (x<limit) {
+                    return x%n;
+                }
+            }
+        }
+        //the i-th value of the purpose that is the same in every universe, it does not change what get() returns
+        int getShared(Purpose purpose, uint64_t i) const {
+            return value(SHARED, purpose, i);
+        }
+        //a continued job keys its values on the restart index as well, so with the same seed it does not replay the
+        //velocity seeds and parents of the job it continues, called by all process with the same index
+        //from a journal, the counters go on from those its records kept instead
+        void resume(uint32_t index, const uint64_t *x) {
+            restart=index;
+            if (x) {
+                std::copy(x, x+PURPOSES, drawn);
+            }
+            if (world->isLeader&&index!=0) {
+                printf("[date=%d] random restart index %u\n", std::time(0), restart);
+            }
+        }
+        //how many values of each purpose were drawn, kept by a checkpoint
+        void save(uint64_t *x) const {
+            std::copy(drawn, drawn+PURPOSES, x);
+        }
+        void restore(const uint64_t *x) {
+            std::copy(x, x+PURPOSES, drawn);
+        }
+    private:
+        //the key of the values shared by all universes, no universe has this id
+        static const uint32_t SHARED=0xffffffff;
+        uint32_t seed,restart;
+        uint64_t drawn[PURPOSES];
+
+        int value(uint32_t stream, Purpose purpose, uint64_t n) const {
+            uint32_t counter[4]={(uint32_t)n, (uint32_t)(n>>32), (uint32_t)purpose, restart};
+            const uint32_t key[2]={seed, stream};
+            philox(counter, key);
+            const int x=counter[0]&0x7fffffff;
+            return x==0 ? 1 : x;
+        }
+
+        static void philox(uint32_t *counter, const uint32_t *key) {
+            uint32_t k0=key[0], k1=key[1];
+            for (int round=0;round<10;round++) {
+                const uint64_t p0=(uint64_t)0xD2511F53*counter[0];
+                const uint64_t p1=(uint64_t)0xCD9E8D57*counter[2];
+                const uint32_t x0=(uint32_t)(p1>>32)^counter[1]^k0;
+                const uint32_t x2=(uint32_t)(p0>>32)^counter[3]^k1;
+                counter[0]=x0;
+                counter[1]=(uint32_t)p1;
+                counter[2]=x2;
+                counter[3]=(uint32_t)p0;
+                k0+=0x9E3779B9;
+                k1+=0xBB67AE85;
+            }
+        }
+};
+
+//an append-only binary file with one fixed record per trial outcome, written by the local leaders without the world
+//leader taking part. trajectory.out.bin of a run becomes trajectory.in.bin of the next one, like the text file
+class FfsJournal: public FfsBranch {
+public:
+    enum Kind {FLUX, SUCCESS, FAILURE, EXTRA};
+    struct Record {
+        int32_t kind;
+        int32_t universe;
+        //layer, branch and n of the parent and of the child configuration, -1 when there is none
+        int32_t parent[3];
+        int32_t lambdaInit;
+        int32_t velocitySeed;
+        int32_t lambdaFinal;
+        int64_t timestep;
+        int32_t child[3];
+        int32_t unused;
+        //values of each purpose the universe had drawn, a continued job goes on from the largest
+        uint64_t drawn[FfsRandomGenerator::PURPOSES];
+    };
+    //called by all local leaders, the file starts empty
+    FfsJournal(const char *filename) {
+        MPI_File_open(FfsBranch::commLeader, (char *)filename, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+        MPI_File_set_size(file, 0);
+        counter=new FfsAtomicCounter(1);
+    }
+    ~FfsJournal() {
+        delete counter;
+        MPI_File_close(&file);
+    }
+    //called by one local leader, the names are the configuration names or 0
+    void append(Kind kind, const char *xyzInit, int lambdaInit, int velocitySeed, int64_t timestep, const char *xyzFinal, int lambdaFinal) {
+        Record r;
+        memset(&r, 0, sizeof(Record));
+        r.kind=kind;
+        r.universe=local->id;
+        parse(xyzInit,r.parent);
+        r.lambdaInit=lambdaInit;
+        r.velocitySeed=velocitySeed;
+        r.lambdaFinal=lambdaFinal;
+        r.timestep=timestep;
+        parse(xyzFinal,r.child);
+        if (randomDrawn) {
+            std::copy(randomDrawn, randomDrawn+FfsRandomGenerator::PURPOSES, r.drawn);
+        }
+        const int64_t slot=counter->add(0,1);
+        MPI_File_write_at(file, slot*sizeof(Record), &r, sizeof(Record), MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+    //read all records in one pass, false when the file does not exist
+    static bool read(const char *filename, std::vector<Record> &records) {
+        FILE *f=fopen(filename,"rb");
+        if (!f) {
+            return false;
+        }
+        fseek(f, 0, SEEK_END);
+        const long n=ftell(f)/sizeof(Record);
+        fseek(f, 0, SEEK_SET);
+        records.resize(n);
+        if (n>0) {
+            records.resize(fread(&records[0], sizeof(Record), n, f));
+        }
+        fclose(f);
+        return true;
+    }
+private:
+    MPI_File file;
+    FfsAtomicCounter *counter;
+
+    static void parse(const char *name, int32_t *x) {
+        int layer,branch,n;
+        if (name&&sscanf(name, "%d__%d_%d", &layer, &branch, &n)==3) {
+            x[0]=layer;
+            x[1]=branch;
+            x[2]=n;
+        }
+        else {
+            x[0]=x[1]=x[2]=-1;
+        }
+    }
+};
 class FfsTrajectoryWriter: public FfsFileWriter {
 public:
     FfsTrajectoryWriter():FfsFileWriter("trajectory.out.txt") {
+        journal=local->isLeader ? new FfsJournal("trajectory.out.bin") : 0;
+    }
+    ~FfsTrajectoryWriter() {
+        delete journal;
     }
     void check() {
         FfsFileWriter::check();
     }
+    FfsPersistentRecv *event() {
+        return FfsFileWriter::event();
+    }
     //write the parameters into the "trajectory.out.txt"
     void writeln(const char *xyzInit,int lambdaInit,int velocitySeed,int64_t timestep,const char *xyzFinal,int lambdaFinal) {
         if (xyzInit==0) {
@@ -292,68 +640,51 @@ public:
         else {
             FfsFileWriter::writeln("%3d (xyz.%s)  >==%010d %20lld==>  %3d (xyz.%s)",lambdaInit,xyzInit,velocitySeed,timestep,lambdaFinal,xyzFinal);
         }
+        record(xyzInit==0 ? FfsJournal::FLUX : FfsJournal::SUCCESS,xyzInit,lambdaInit,velocitySeed,timestep,xyzFinal,lambdaFinal);
+    }
+    //only in the journal: the outcomes that are not a stored configuration
+    void record(FfsJournal::Kind kind,const char *xyzInit,int lambdaInit,int velocitySeed,int64_t timestep,const char *xyzFinal,int lambdaFinal) {
+        if (journal) {
+            journal->append(kind,xyzInit,lambdaInit,velocitySeed,timestep,xyzFinal,lambdaFinal);
+        }
     }
+private:
+    FfsJournal *journal;
 };
 class FfsTrajectoryReader: FfsBranch {
 public:
+    //the configurations of a previous run, from trajectory.in.bin or else trajectory.in.txt
+    //the world leader reads the file once and each local leader gets its own branch with one scatter
     FfsTrajectoryReader() {
-        int n;
-        int *p;
-        if (world->isLeader) {
+        restartIndex=0;
+        fromJournal=0;
+        std::fill(drawn, drawn+FfsRandomGenerator::PURPOSES, 0);
+        if (local->isLeader) {
+            //v[branch] = {layer, count, lambda, ...}
             std::vector< std::vector<int> > v;
-            v.resize(FfsBranch::size);
-            FILE *f=fopen("trajectory.in.txt","r");
-            //attention: here only the world part do the while, v is a vector with structure as v[brunch] = {layer, count, lambda}
-            while (1) {
-                int lambda,layer,branch,count;
-                //ignore the string and char, read the int number and store in the 4 variable
-                int ret=fscanf(f,"%*s%*s%*s%*s%*s%d%*[^.]%*c%d%*c%*c%d%*c%d%*[^\n]%*c",&lambda,&layer,&branch,&count);
-                if (ret==EOF) {
-                    break;
+            std::vector<int> counts, displs, all;
+            std::vector<uint64_t> allDrawn;
+            if (world->isLeader) {
+                v.resize(FfsBranch::size);
+                allDrawn.assign(FfsRandomGenerator::PURPOSES*FfsBranch::size,0);
+                fromJournal=readJournal("trajectory.in.bin",v,allDrawn);
+                if (!fromJournal) {
+                    readText("trajectory.in.txt",v);
+                    restartIndex=hashFile("trajectory.in.txt");
+                }
+                for (int i=0;i<(int)v.size();i++) {
+                    counts.push_back(v[i].size());
+                    displs.push_back(all.size());
+                    all.insert(all.end(),v[i].begin(),v[i].end());
                 }
-                //it's a two-dimensional vector
-                v[branch].push_back(layer);
-                v[branch].push_back(count);
-                v[branch].push_back(lambda);
+                all.push_back(0);
             }
-            fclose(f);
-            int i,j;
-            if (1) {
-                //copy the first vector in v to the pointer "p" address
-                const std::vector<int> vv=v[0];
-                n=vv.size();
-                p=new int[n];
-                std::copy(vv.begin(),vv.end(),p);
-            }
-            for (int i=1;i<(int)v.size();i++) {
-                //copy the information and send it to the local leader process
-                const std::vector<int> &vv=v[i];
-                int nn=vv.size();
-                int *pp=new int[nn];
-                for (j=0;j<nn;j++) {
-                    pp[j]=vv[j];
-                }
-                printf("[date=%d] world leader will send TAG_FILEREADER to %d\n", std::time(0), i);
-                MPI_Send(pp, nn, MPI_INT, i, FfsBranch::TAG_FILEREADER, FfsBranch::commLeader);
-                printf("[date=%d] world leader did send TAG_FILEREADER to %d\n", std::time(0), i);
-                delete[] pp;
-            }
-        }
-        else if (local->isLeader) {
-            MPI_Status status;
-            //check if there is information in the communicator, and count it
-            MPI_Probe(0, FfsBranch::TAG_FILEREADER, FfsBranch::commLeader, &status);
-            MPI_Get_count(&status,MPI_INT,&n);
-            p=new int[n];
-            printf("[date=%d] universe %d will receive TAG_FILEREADER\n", std::time(0), local->id);
-            //receive and store it in the pointer p
-            MPI_Recv(p, n, MPI_INT, 0, FfsBranch::TAG_FILEREADER, FfsBranch::commLeader, &status);
-            printf("[date=%d] universe %d did receive TAG_FILEREADER\n", std::time(0), local->id);
-        }
-        //receive and store value
-        if (local->isLeader) {
-            int i;
-            for (i=0;i+2<n;i+=3) {
+            int n;
+            MPI_Scatter(world->isLeader ? &counts[0] : 0, 1, MPI_INT, &n, 1, MPI_INT, 0, FfsBranch::commLeader);
+            std::vector<int> p(n+1);
+            MPI_Scatterv(world->isLeader ? &all[0] : 0, world->isLeader ? &counts[0] : 0, world->isLeader ? &displs[0] : 0, MPI_INT, &p[0], n, MPI_INT, 0, FfsBranch::commLeader);
+            MPI_Scatter(world->isLeader ? &allDrawn[0] : 0, FfsRandomGenerator::PURPOSES, MPI_UNSIGNED_LONG_LONG, drawn, FfsRandomGenerator::PURPOSES, MPI_UNSIGNED_LONG_LONG, 0, FfsBranch::commLeader);
+            for (int i=0;i+2<n;i+=3) {
                 int layer=p[i];
                 int count=p[i+1];
                 int lambda=p[i+2];
@@ -366,10 +697,21 @@ public:
                 }
                 v[count]=lambda;
             }
-            delete[] p;
         }
         //make sure all the process has been finished
         MPI_Barrier(FfsBranch::commLocal);
+        MPI_Bcast(&restartIndex, 1, MPI_UNSIGNED, 0, world->comm);
+        MPI_Bcast(&fromJournal, 1, MPI_INT, 0, world->comm);
+        MPI_Bcast(drawn, FfsRandomGenerator::PURPOSES, MPI_UNSIGNED_LONG_LONG, 0, FfsBranch::commLocal);
+    }
+
+    //a job continued from trajectory.in.txt draws other random numbers than the job that wrote it, 0 for a new run
+    uint32_t getRestartIndex() const {
+        return restartIndex;
+    }
+    //the random counters this universe had reached in the journal, 0 when the run is not continued from one
+    const uint64_t *getDrawn() const {
+        return fromJournal ? drawn : 0;
     }
 
     //get the vector of lambda according to the number of layer
@@ -397,18 +739,195 @@ public:
 private:
     std::vector< std::vector<int> > lambdaLocal;
     std::vector<int> emptyVector;
+    uint32_t restartIndex;
+    int fromJournal;
+    uint64_t drawn[FfsRandomGenerator::PURPOSES];
+
+    //FNV-1a of the whole file, every job appends to the trajectories so each continuation gets another value
+    static uint32_t hashFile(const char *filename) {
+        FILE *f=fopen(filename,"rb");
+        if (!f) {
+            return 0;
+        }
+        uint32_t h=2166136261u;
+        bool empty=true;
+        int c;
+        while ((c=fgetc(f))!=EOF) {
+            h=(h^(uint32_t)c)*16777619u;
+            empty=false;
+        }
+        fclose(f);
+        return empty ? 0 : h;
+    }
+
+    //the configuration of a record goes to the branch that found it
+    static void add(std::vector< std::vector<int> > &v, int layer, int branch, int count, int lambda) {
+        if (branch<0||branch>=(int)v.size()) {
+            fprintf(stderr, "Configuration %d__%d_%d of the previous run is ignored, there are %d universes\n", layer, branch, count, (int)v.size());
+            return;
+        }
+        v[branch].push_back(layer);
+        v[branch].push_back(count);
+        v[branch].push_back(lambda);
+    }
+    static bool readJournal(const char *filename, std::vector< std::vector<int> > &v, std::vector<uint64_t> &drawn) {
+        std::vector<FfsJournal::Record> records;
+        if (!FfsJournal::read(filename,records)) {
+            return false;
+        }
+        for (int i=0;i<(int)records.size();i++) {
+            const FfsJournal::Record &r=records[i];
+            if ((r.kind==FfsJournal::FLUX||r.kind==FfsJournal::SUCCESS)&&r.child[0]>=0) {
+                add(v,r.child[0],r.child[1],r.child[2],r.lambdaFinal);
+            }
+            if (r.universe>=0&&r.universe<(int)v.size()) {
+                for (int k=0;k<FfsRandomGenerator::PURPOSES;k++) {
+                    const int i=FfsRandomGenerator::PURPOSES*r.universe+k;
+                    drawn[i]=std::max(drawn[i],r.drawn[k]);
+                }
+            }
+        }
+        return true;
+    }
+    //the text format, for runs without a journal
+    static void readText(const char *filename, std::vector< std::vector<int> > &v) {
+        FILE *f=fopen(filename,"r");
+        if (!f) {
+            return;
+        }
+        while (1) {
+            int lambda,layer,branch,count;
+            //ignore the string and char, read the int number and store in the 4 variable
+            int ret=fscanf(f,"%*s%*s%*s%*s%*s%d%*[^.]%*c%d%*c%*c%d%*c%d%*[^\n]%*c",&lambda,&layer,&branch,&count);
+            if (ret==EOF) {
+                break;
+            }
+            add(v,layer,branch,count,lambda);
+        }
+        fclose(f);
+    }
+};
+//a signal raised once by the world leader and seen by every local leader, it travels along the tree of a nonblocking
+//broadcast that the others posted in advance, so neither the world leader nor anyone else loops over the universes
+class FfsSignal: public FfsBranch {
+public:
+    //called by all local leaders
+    FfsSignal() {
+        MPI_Comm_dup(FfsBranch::commLeader, &comm);
+        raised=false;
+        if (!world->isLeader) {
+            MPI_Ibcast(&value, 1, MPI_INT, 0, comm, &request);
+        }
+    }
+    ~FfsSignal() {
+        //the receivers wait for it, so it is raised at the latest here
+        raise();
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        MPI_Comm_free(&comm);
+    }
+    //only on the world leader
+    void raise() {
+        if (world->isLeader&&!raised) {
+            value=1;
+            MPI_Ibcast(&value, 1, MPI_INT, 0, comm, &request);
+            raised=true;
+        }
+    }
+    //on the other local leaders, true once the signal has arrived
+    bool test() {
+        if (!raised) {
+            int flag;
+            MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+            raised=flag;
+        }
+        return raised;
+    }
+private:
+    MPI_Comm comm;
+    MPI_Request request;
+    //an empty broadcast could complete without the root, so it carries one number
+    int value;
+    bool raised;
+};
+//shares a decision of the local leader with the whole universe through a nonblocking broadcast,
+//every process gets the decision of the previous call, so the broadcast completes during the next batch
+class FfsLocalFlag: public FfsBranch {
+public:
+    FfsLocalFlag() {
+        pending=false;
+    }
+    ~FfsLocalFlag() {
+        reset();
+    }
+
+    //decided is only read on the local leader, once 0 is returned nothing is sent until reset()
+    int share(int decided) {
+        if (local->size==1) {
+            return decided;
+        }
+        int ret=1;
+        if (pending) {
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+            pending=false;
+            ret=value;
+        }
+        if (ret) {
+            value=decided;
+            MPI_Ibcast(&value, 1, MPI_INT, 0, FfsBranch::commFlag, &request);
+            pending=true;
+        }
+        return ret;
+    }
+
+    //forget the decision still on the way, called by all process of the universe
+    void reset() {
+        if (pending) {
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+            pending=false;
+        }
+    }
+private:
+    MPI_Request request;
+    int value;
+    bool pending;
+};
+//what a running trial asks after every batch, next() turns false once the interface it shoots to is complete
+class FfsQuota: public FfsBranch {
+public:
+    virtual ~FfsQuota() {
+    }
+    virtual bool next()=0;
 };
-class FfsCountdown: public FfsBranch {
+//the successes are summed in an atomic counter of the world leader, only the universe that completes the quota tells it,
+//and the world leader spreads the termination with a FfsSignal, so no step is linear in the number of universes
+class FfsCountdown: public FfsQuota {
 public:
     //when n <= 0, the terminated label turns to true
-    FfsCountdown(int n) {
+    FfsCountdown(int n,int layer=0):layer(layer) {
+        quota=n;
         remains=n;
         terminated=n<=0;
+        stopping=terminated;
+        complete=false;
+        counter=0;
+        signal=0;
+        doneRecv=0;
+        //the counter and the signal are set up once, the hot path only tests local requests
+        if (!terminated&&local->isLeader&&FfsBranch::size>1) {
+            counter=new FfsAtomicCounter(1);
+            signal=new FfsSignal();
+            if (world->isLeader) {
+                doneRecv=new FfsPersistentRecv(doneBuffer, 2, MPI_INT, MPI_ANY_SOURCE, FfsBranch::TAG_COUNTDOWN_DONE, FfsBranch::commLeader);
+            }
+        }
     }
     ~FfsCountdown() {
+        delete doneRecv;
+        delete signal;
+        delete counter;
     }
 
-    //send the variable n to the communicator
+    //count n successes
     //the done function must be continued by next() function
     void done(int n=1) {
         //only consider the local leader process
@@ -417,96 +936,95 @@ public:
         }
 
         //check if the object has already been terminated
-        if (terminated) {
+        if (stopping) {
             return ;
         }
-        int x=n;
-        if (world->isLeader) {
-            remains-=x;
+        if (!counter) {
+            remains-=n;
+            return ;
         }
-        else {
-            printf("[date=%d] universe %d will send TAG_COUNTDOWN_DONE\n", std::time(0), local->id);
-            //send the variable, n, to the world leader process, with tag FfsBranch::TAG_COUNTDOWN_DONE
-            MPI_Send(&x, 1, MPI_INT, 0, FfsBranch::TAG_COUNTDOWN_DONE, FfsBranch::commLeader);
-            printf("[date=%d] universe %d did send TAG_COUNTDOWN_DONE\n", std::time(0), local->id);
+        const int64_t before=counter->add(0,n);
+        //exactly one universe sees the quota reached
+        if (before<quota&&before+n>=quota) {
+            if (world->isLeader) {
+                complete=true;
+            }
+            else {
+                int x[2]={layer,n};
+                printf("[date=%d] universe %d will send TAG_COUNTDOWN_DONE\n", std::time(0), local->id);
+                MPI_Send(x, 2, MPI_INT, 0, FfsBranch::TAG_COUNTDOWN_DONE, FfsBranch::commLeader);
+                printf("[date=%d] universe %d did send TAG_COUNTDOWN_DONE\n", std::time(0), local->id);
+            }
         }
     }
 
     //check if there's next
+    //every process of the universe stops one check after the leader has seen the termination
     bool next() {
         if (terminated) {
             return false;
         }
-        int ret;
+        int decided=1;
         //only the local leader process handle the data
         if (local->isLeader) {
-            if (world->isLeader) {
-                //continuosly receive data
-                while (1) {
-                    int flag;
-                    //store the MPI information
-                    MPI_Status status;
-                    //check if there's message tagged with countdown
-                    MPI_Iprobe(MPI_ANY_SOURCE, FfsBranch::TAG_COUNTDOWN_DONE, FfsBranch::commLeader, &flag, &status);
-                    if (flag) {
-                        int x;
-                        printf("[date=%d] world leader will receive TAG_COUNTDOWN_DONE from %d\n", std::time(0), status.MPI_SOURCE);
-                        //receive the data from other process
-                        MPI_Recv(&x, 1, MPI_INT, status.MPI_SOURCE, status.MPI_TAG, FfsBranch::commLeader, &status);
-                        printf("[date=%d] world leader did receive TAG_COUNTDOWN_DONE from %d\n", std::time(0), status.MPI_SOURCE);
-                        remains-=x;
-                    }
-                    else {
-                        break;
-                    }
-                }
-                //there is no remains
-                if (remains<=0) {
-                    terminated=true;
-                    int i;
-                    for (i = 1; i < FfsBranch::size; i += 1) {
-                        printf("[date=%d] world leader will send TAG_COUNTDOWN_TERMINATE to %d\n", std::time(0), i);
-                        //send a message to all local leader for terminate
-                        MPI_Send(0, 0, MPI_INT, i, FfsBranch::TAG_COUNTDOWN_TERMINATE, FfsBranch::commLeader);
-                        printf("[date=%d] world leader did send TAG_COUNTDOWN_TERMINATE to %d\n", std::time(0), i);
-                    }
-                    ret=0;
-                }
-                else {
-                    ret=1;
-                }
-            }
-            else {
-                int flag;
-                MPI_Status status;
-                //check if there's message about terminate
-                MPI_Iprobe(0, FfsBranch::TAG_COUNTDOWN_TERMINATE, FfsBranch::commLeader, &flag, &status);
-                if (flag) {
-                    terminated=true;
-                    printf("[date=%d] universe %d will receive TAG_COUNTDOWN_TERMINATE\n", std::time(0), local->id);
-                    MPI_Recv(0, 0, MPI_INT, 0, FfsBranch::TAG_COUNTDOWN_TERMINATE, FfsBranch::commLeader, &status);
-                    printf("[date=%d] universe %d did receive TAG_COUNTDOWN_TERMINATE\n", std::time(0), local->id);
-                    ret=0;
-                }
-                else {
-                    ret=1;
-                }
-            }
+            decided=poll();
         }
-        //broadcast the value of ret
-        //let Local leader share the data to the non-leader process
-        MPI_Bcast(&ret, 1, MPI_INT, 0, FfsBranch::commLocal);
-        if (ret==0) {
+        if (flag.share(decided)==0) {
             terminated=true;
         }
-        return ret;
+        return !terminated;
+    }
+
+    //the receive that can wake up the dedicated coordinator, null when there is nothing to wait for
+    FfsPersistentRecv *event() {
+        return stopping ? 0 : doneRecv;
     }
 private:
-    //label the status of the object
-    bool terminated;
+    int layer;
+
+    //label the status of the object, stopping is known by the local leader one check before terminated
+    bool terminated,stopping;
+
+    //the world leader completed the quota itself
+    bool complete;
+
+    //the number of configurations to collect, and the remains when there is a single universe
+    int quota,remains;
 
-    //the number of remains
-    int remains;
+    FfsAtomicCounter *counter;
+    FfsSignal *signal;
+    FfsPersistentRecv *doneRecv;
+    int doneBuffer[2];
+    FfsLocalFlag flag;
+
+    //handle the arrived messages on the local leader, return 0 when the countdown is over
+    int poll() {
+        if (stopping) {
+            return 0;
+        }
+        if (!counter) {
+            stopping=remains<=0;
+        }
+        else if (world->isLeader) {
+            if (!complete&&doneRecv->test(0)) {
+                printf("[date=%d] world leader did receive TAG_COUNTDOWN_DONE\n", std::time(0));
+                complete=doneBuffer[0]==layer;
+                if (!complete) {
+                    doneRecv->restart();
+                }
+            }
+            if (complete) {
+                stopping=true;
+                printf("[date=%d] world leader will signal the end of interface %d\n", std::time(0), layer);
+                signal->raise();
+            }
+        }
+        else if (signal->test()) {
+            printf("[date=%d] universe %d did receive the end of interface %d\n", std::time(0), local->id, layer);
+            stopping=true;
+        }
+        return stopping ? 0 : 1;
+    }
 };
 class FfsFileTree: public FfsBranch {
 public:
@@ -546,28 +1064,17 @@ public:
         if (local->isLeader) {
             //get the global value of lambda size and store in b
             MPI_Allreduce(a, b, FfsBranch::size, MPI_INT, MPI_SUM, FfsBranch::commLeader);
-            int mySize=lambdaLocal.size();
-            int currentSize;
-            //store the total size of lambdaLocal in each process
-            int maxSize;
-            MPI_Allreduce(&mySize, &maxSize, 1, MPI_INT, MPI_MAX, FfsBranch::commLeader);
-            int *p=new int[maxSize];
-            int i,j;
-            for (i = 0; i < FfsBranch::size; i += 1) {
-                if (i==local->id) {
-                    currentSize=mySize;
-                    std::copy(lambdaLocal.begin(),lambdaLocal.end(),p);
-                }
-                //there is a deadlock, share the data to all the shooting
-                MPI_Bcast(&currentSize, 1, MPI_INT, i, FfsBranch::commLeader);
-                MPI_Bcast(p, currentSize, MPI_INT, i, FfsBranch::commLeader);
-                //copy the p to the lambdaGlobal
-                for (j=0;j<currentSize;j++) {
-                    //lambdaGlobal stores the lambda value in all shooting
-                    lambdaGlobal.push_back(p[j]);
-                }
-            }
-            delete[] p;
+            //one gather of all lambda values, the sizes are b
+            std::vector<int> displs(FfsBranch::size);
+            int all=0;
+            for (int i = 0; i < FfsBranch::size; i += 1) {
+                displs[i]=all;
+                all+=b[i];
+            }
+            std::vector<int> mine(lambdaLocal.begin(),lambdaLocal.end());
+            std::vector<int> p(all);
+            MPI_Allgatherv(mine.empty() ? 0 : &mine[0], mine.size(), MPI_INT, p.empty() ? 0 : &p[0], b, &displs[0], MPI_INT, FfsBranch::commLeader);
+            lambdaGlobal.insert(lambdaGlobal.end(),p.begin(),p.end());
         }
         /*note that, above procedure only execute in the local Leader process,
         *so we need below procedure to copy that to all other process
@@ -576,8 +1083,12 @@ public:
         //broadcast the value of b to all the process in the same shooting
         MPI_Bcast(b, FfsBranch::size, MPI_INT, 0, FfsBranch::commLocal);
         total=0;
+        owner.clear();
+        first.resize(FfsBranch::size);
         for (int i = 0; i < FfsBranch::size; i += 1) {
+            first[i]=total;
             total+=b[i];
+            owner.insert(owner.end(),b[i],i);
         }
         int allSize=lambdaGlobal.size();
         MPI_Bcast(&allSize, 1, MPI_INT, 0, FfsBranch::commLocal);
@@ -596,17 +1107,24 @@ public:
         }
         delete[] p;
     }
+    //the interface of the configurations of this tree
+    int getLayer() const {
+        return layer;
+    }
     const std::string getName(int x) const {
+        int branchId,n;
+        split(x,&branchId,&n);
+        return generateName(n,branchId);
+    }
+    //find the universe and its own count of the x-th configuration of the committed layer
+    void split(int x, int *branchId, int *n) const {
         x%=total;
-        int i;
-        for (i = 0; i < FfsBranch::size; i += 1) {
-            if (x<b[i]) {
-                return generateName(x,i);
-            }
-            else {
-                x-=b[i];
-            }
-        }
+        *branchId=owner[x];
+        *n=x-first[owner[x]];
+    }
+    //the number of configurations of the committed layer found by a universe
+    int getCount(int branchId) const {
+        return b[branchId];
     }
     int getLambda(int x) const {
         return lambdaGlobal[x%total];
@@ -614,6 +1132,12 @@ public:
     int getTotal() const {
         return total;
     }
+    //the name "layer__branchId_x" of a configuration
+    static const std::string nameOf(int layer, int branchId, int x) {
+        static char c[100];
+        sprintf(c,"%d__%d_%d",layer,branchId,x);
+        return c;
+    }
 private:
     int layer;
 
@@ -625,133 +1149,2426 @@ private:
     //lambdaGlobal stores the lambda value in all shooting in the certain layer
     std::vector<int> lambdaGlobal;
     int total;
+    //the universe of each configuration of lambdaGlobal, and the index of the first configuration of each universe
+    std::vector<int> owner,first;
     //generate a string with format "layer__branchId_inputparameter", and return it
     const std::string generateName(int x, int branchId=-1) const {
         if (branchId==-1) {
             branchId=local->id;
         }
-        static char c[100];
-        sprintf(c,"%d__%d_%d",layer,branchId,x);
-        return c;
+        return nameOf(layer,branchId,x);
     }
 };
 
-//initialize the ffs process
-bool ffsRequested(int argc, char **argv) {
-    int i;
-    for (i=0;i<argc;i++) {
-        //search for the string "-ffs"
-        if (strcmp(argv[i],"-ffs")==0) {
-            //judge if there's 2 parameters after "-ffs", exemple: -ffs 512 ffs.input
-            if (i+2<argc) {
-                int numberShooting;
-                //assign the first parameter to numberShooting
-                if (sscanf(argv[i+1],"%d",&numberShooting)==1) {
-                    MPI_Comm worldComm;
-                    MPI_Comm_dup(MPI_COMM_WORLD,&worldComm);
-                    //world is an instance which stores the communicator with each process is ffs
-                    world=new MpiInfo(worldComm);
-                    if (world->size>0&&numberShooting>0&&world->size%numberShooting==0) {
-                        //the cpu number assigned to each shooting
-                        int cpuEach=world->size/numberShooting;
-                        //which shooting the current procedure need to handle
-                        int myShooting=world->rank/cpuEach;
-                        MPI_Comm localComm;
-                        //seperate the process by myShooting
-                        MPI_Comm_split(world->comm,myShooting,world->rank,&localComm);
-                        local=new MpiInfo(localComm,myShooting);
-                    }
-                }
-                else {
+//the sizes of the universes given to -ffs: "n" universes of equal size, the first ones get one more process when n does not
+//divide the number of process, or a list "size,size,..." where "kxsize" stands for k universes of that size
+static bool parseLayout(const char *layout, int worldSize, std::vector<int> *sizes) {
+    int n,used;
+    if (!strchr(layout,',')&&!strchr(layout,'x')) {
+        if (sscanf(layout,"%d%n",&n,&used)!=1||layout[used]!='\0'||n<=0||n>worldSize) {
+            return false;
+        }
+        for (int i=0;i<n;i++) {
+            sizes->push_back(worldSize/n+(i<worldSize%n ? 1 : 0));
+        }
+        return true;
+    }
+    for (const char *p=layout;*p;) {
+        int k=1,size;
+        if (sscanf(p,"%dx%d%n",&k,&size,&used)!=2) {
+            k=1;
+            if (sscanf(p,"%d%n",&size,&used)!=1) {
+                return false;
+            }
+        }
+        if (k<=0||size<=0) {
+            return false;
+        }
+        sizes->insert(sizes->end(),k,size);
+        p+=used;
+        if (*p==',') {
+            p++;
+        }
+        else if (*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//place the universes inside the nodes, so the process of a universe share memory, the universes are given to the nodes from
+//the largest to the smallest, a universe goes to the first node with room left for it. the result is the universe of the
+//calling process, or -1, the universes are numbered again by the rank of their leader afterwards
+static int placeOnNodes(const std::vector<int> &sizes) {
+    MPI_Comm nodeComm,nodeLeaders;
+    int nodeRank,nodeSize,node,nodes;
+    MPI_Comm_split_type(world->comm,MPI_COMM_TYPE_SHARED,world->rank,MPI_INFO_NULL,&nodeComm);
+    MPI_Comm_rank(nodeComm,&nodeRank);
+    MPI_Comm_size(nodeComm,&nodeSize);
+    MPI_Comm_split(world->comm,nodeRank==0 ? 0 : MPI_UNDEFINED,world->rank,&nodeLeaders);
+    //the world leader is the first node leader, it gets the size of every node
+    std::vector<int> capacity;
+    if (nodeRank==0) {
+        MPI_Comm_rank(nodeLeaders,&node);
+        MPI_Comm_size(nodeLeaders,&nodes);
+        capacity.resize(nodes);
+        MPI_Gather(&nodeSize,1,MPI_INT,&capacity[0],1,MPI_INT,0,nodeLeaders);
+        MPI_Comm_free(&nodeLeaders);
+    }
+    MPI_Bcast(&node,1,MPI_INT,0,nodeComm);
+    std::vector<int> nodeOf(sizes.size(),-1);
+    if (world->isLeader) {
+        //first fit decreasing, the small universes fill what the large ones leave, whatever the order of the layout
+        std::vector< std::pair<int,int> > order;
+        for (size_t u=0;u<sizes.size();u++) {
+            order.push_back(std::make_pair(-sizes[u],(int)u));
+        }
+        std::sort(order.begin(),order.end());
+        for (size_t k=0;k<order.size();k++) {
+            const int u=order[k].second;
+            for (int i=0;i<nodes;i++) {
+                if (capacity[i]>=sizes[u]) {
+                    capacity[i]-=sizes[u];
+                    nodeOf[u]=i;
+                    break;
+                }
+            }
+            if (nodeOf[u]<0) {
+                fprintf(stderr, "Universe %d of %d process does not fit in a node\n", u, sizes[u]);
+                MPI_Abort(world->comm,1);
+            }
+        }
+    }
+    MPI_Bcast(&nodeOf[0],sizes.size(),MPI_INT,0,world->comm);
+    MPI_Comm_free(&nodeComm);
+    //the universes of the node take its process in order
+    int first=0;
+    for (size_t u=0;u<sizes.size();u++) {
+        if (nodeOf[u]!=node) {
+            continue;
+        }
+        if (nodeRank<first+sizes[u]) {
+            return u;
+        }
+        first+=sizes[u];
+    }
+    return -1;
+}
+
+//print which node each universe runs on, whatever the hostfile and rank mapping of the job
+static void reportUniverses() {
+    struct Place {
+        int universe,leader,nodes;
+        char host[64];
+    } place;
+    //the number of nodes of the universe is the number of its process that lead their share of it
+    MPI_Comm shared;
+    int sharedRank;
+    MPI_Comm_split_type(local->comm,MPI_COMM_TYPE_SHARED,local->rank,MPI_INFO_NULL,&shared);
+    MPI_Comm_rank(shared,&sharedRank);
+    MPI_Comm_free(&shared);
+    int first=sharedRank==0;
+    MPI_Allreduce(&first,&place.nodes,1,MPI_INT,MPI_SUM,local->comm);
+    place.universe=local->id;
+    place.leader=local->isLeader;
+    char host[MPI_MAX_PROCESSOR_NAME];
+    int length;
+    MPI_Get_processor_name(host,&length);
+    memset(place.host,0,sizeof(place.host));
+    strncpy(place.host,host,sizeof(place.host)-1);
+    std::vector<Place> all(world->isLeader ? world->size : 0);
+    MPI_Gather(&place,sizeof(Place),MPI_CHAR,world->isLeader ? &all[0] : 0,sizeof(Place),MPI_CHAR,0,world->comm);
+    if (world->isLeader) {
+        std::vector<int> sizes(world->size,0);
+        for (int i=0;i<world->size;i++) {
+            sizes[all[i].universe]++;
+        }
+        for (int i=0;i<world->size;i++) {
+            if (all[i].leader) {
+                printf("[date=%d] [universe=%d] [size=%d] [node=%s] [nodes=%d]\n", std::time(0), all[i].universe, sizes[all[i].universe], all[i].host, all[i].nodes);
+            }
+        }
+    }
+}
+
+//initialize the ffs process
+//called before MPI is initialized, every process reads the ffs input itself: true when it asks for instances k > 1,
+//whose lammps instances run on threads of their own and need MPI_THREAD_MULTIPLE
+bool ffsThreaded(int argc, char **argv) {
+    for (int i=0;i+2<argc;i++) {
+        if (strcmp(argv[i],"-ffs")==0) {
+            std::map<std::string,std::string> dict;
+            if (!FfsFileReader::read(argv[i+2],&dict)) {
+                return false;
+            }
+            int instances=1,replicas=1;
+            if (dict.count("instances")) {
+                sscanf(dict["instances"].c_str(),"%d",&instances);
+            }
+            if (dict.count("replicas")) {
+                sscanf(dict["replicas"].c_str(),"%d",&replicas);
+            }
+            //instances is not used with replicas
+            return instances>1&&replicas<=1;
+        }
+    }
+    return false;
+}
+
+bool ffsRequested(int argc, char **argv) {
+    int i;
+    for (i=0;i<argc;i++) {
+        //search for the string "-ffs"
+        if (strcmp(argv[i],"-ffs")==0) {
+            //judge if there's 2 parameters after "-ffs", exemple: -ffs 512 ffs.input
+            if (i+2<argc) {
+                //"node:" before the layout keeps every universe inside a node
+                const char *layout=argv[i+1];
+                const bool nodeAware=strncmp(layout,"node:",5)==0;
+                if (nodeAware) {
+                    layout+=5;
+                }
+                MPI_Comm worldComm;
+                MPI_Comm_dup(MPI_COMM_WORLD,&worldComm);
+                //world is an instance which stores the communicator with each process is ffs
+                world=new MpiInfo(worldComm);
+                std::vector<int> sizes;
+                if (!parseLayout(layout,world->size,&sizes)) {
+                    MPI_Comm_free(&worldComm);
+                    delete world;
                     return false;
                 }
-                //read the file of ffs.input
-                ffsParams=new FfsFileReader(argv[i+2]);
-                return true;
+                int total=0;
+                for (size_t u=0;u<sizes.size();u++) {
+                    total+=sizes[u];
+                }
+                if (total!=world->size) {
+                    if (world->isLeader) {
+                        fprintf(stderr, "The universes of -ffs %s have %d process, the job has %d\n", argv[i+1], total, world->size);
+                    }
+                    MPI_Abort(world->comm,1);
+                }
+                //which shooting the current procedure need to handle, the universes are contiguous blocks of ranks otherwise
+                int myShooting=0;
+                if (nodeAware) {
+                    myShooting=placeOnNodes(sizes);
+                }
+                else {
+                    for (int first=0;world->rank>=first+sizes[myShooting];myShooting++) {
+                        first+=sizes[myShooting];
+                    }
+                }
+                MPI_Comm localComm;
+                //seperate the process by myShooting
+                MPI_Comm_split(world->comm,myShooting,world->rank,&localComm);
+                //the universes are numbered in the order of the world rank of their leaders, as the leaders are in commLeader
+                int leader,id;
+                MPI_Comm_rank(localComm,&leader);
+                MPI_Comm leaders;
+                MPI_Comm_split(world->comm,leader==0 ? 0 : MPI_UNDEFINED,world->rank,&leaders);
+                if (leader==0) {
+                    MPI_Comm_rank(leaders,&id);
+                    MPI_Comm_free(&leaders);
+                }
+                MPI_Bcast(&id,1,MPI_INT,0,localComm);
+                local=new MpiInfo(localComm,id);
+                reportUniverses();
+                //read the file of ffs.input
+                ffsParams=new FfsFileReader(argv[i+2]);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//the choice of the parent of each trial among the configurations of the last interface
+//uniform: every configuration is equally likely
+//stratified: the universes that shoot take the next place of one shuffled order of the configurations from a counter kept by
+//the world leader, so each is used before any is used twice however often each universe draws
+//branch: every universe that found configurations gives the same share of parents, drawn with an alias table
+class FfsParentSelector: public FfsBranch {
+public:
+    enum Policy {UNIFORM, STRATIFIED, BRANCH};
+    //layers is the number of interfaces, called by all process
+    FfsParentSelector(int layers) {
+        const std::string name=ffsParams->getString("parent_selection","uniform");
+        policy=UNIFORM;
+        if (name=="stratified") {
+            policy=STRATIFIED;
+        }
+        else if (name=="branch") {
+            policy=BRANCH;
+        }
+        else if (world->isLeader&&name!="uniform") {
+            fprintf(stderr, "Unknown parent_selection \"%s\" in ffs input, using uniform\n", name.c_str());
+        }
+        total=0;
+        layer=0;
+        //one counter per interface, so a universe still drawing at one does not share it with those at the next
+        counter=0;
+        if (policy==STRATIFIED&&local->isLeader) {
+            counter=new FfsAtomicCounter(layers);
+        }
+    }
+    ~FfsParentSelector() {
+        delete counter;
+    }
+
+    //the parents are the configurations of the committed tree, called by all process of the universe
+    void prepare(const FfsFileTree *tree, const FfsRandomGenerator *rng) {
+        total=tree->getTotal();
+        layer=tree->getLayer();
+        if (policy==STRATIFIED) {
+            //Fisher-Yates with the values shared by all universes, so they all have the same order
+            order.resize(total);
+            for (int i=0;i<total;i++) {
+                order[i]=i;
+            }
+            uint64_t k=(uint64_t)tree->getLayer()<<32;
+            for (int i=total-1;i>0;i--) {
+                const uint32_t limit=0x7fffffff-0x7fffffff%(uint32_t)(i+1);
+                uint32_t x;
+                do {
+                    x=rng->getShared(FfsRandomGenerator::PARENT,k++)-1;
+                } while (x>=limit);
+                std::swap(order[i],order[x%(i+1)]);
+            }
+        }
+        else if (policy==BRANCH) {
+            std::vector<double> weight(total);
+            int branches=0;
+            for (int i=0;i<FfsBranch::size;i++) {
+                branches+=tree->getCount(i)>0;
+            }
+            for (int x=0;x<total;x++) {
+                int branchId,n;
+                tree->split(x,&branchId,&n);
+                weight[x]=(double)total/(branches*tree->getCount(branchId));
+            }
+            buildAlias(weight);
+        }
+    }
+
+    //the index of the next parent, for FfsFileTree::getName and getLambda
+    int draw(FfsRandomGenerator *rng) {
+        if (policy==STRATIFIED) {
+            int64_t k=0;
+            if (local->isLeader) {
+                k=counter->add(layer,1);
+            }
+            MPI_Bcast(&k, 1, MPI_LONG_LONG, 0, local->comm);
+            return order[(int)(k%total)];
+        }
+        const int x=rng->below(FfsRandomGenerator::PARENT,total);
+        if (policy==BRANCH) {
+            const double u=(rng->get(FfsRandomGenerator::PARENT)-1)/2147483647.0;
+            return u<probability[x] ? x : alias[x];
+        }
+        return x;
+    }
+private:
+    Policy policy;
+    int total,layer;
+    //with stratified, the places of the order taken by all universes at each interface
+    FfsAtomicCounter *counter;
+    std::vector<int> order;
+    std::vector<double> probability;
+    std::vector<int> alias;
+
+    //Vose's alias method, the weights have a mean of 1
+    void buildAlias(std::vector<double> &weight) {
+        const int n=weight.size();
+        probability.assign(n,1.0);
+        alias.resize(n);
+        std::vector<int> small,large;
+        for (int i=0;i<n;i++) {
+            alias[i]=i;
+            (weight[i]<1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty()&&!large.empty()) {
+            const int s=small.back();
+            const int l=large.back();
+            small.pop_back();
+            probability[s]=weight[s];
+            alias[s]=l;
+            weight[l]-=1.0-weight[s];
+            if (weight[l]<1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+    }
+};
+
+//with replicas k, the lammps instance holds k copies of the system that do not interact, replica r has the atom ids
+//r*n+1..(r+1)*n. the driver gives each replica its own trajectory, and a snapshot holds the selected replica only,
+//so the pools store and load single replicas and a configuration can go to any replica
+class FfsReplicas {
+public:
+    //called by all process of the universe, after the lammps input
+    FfsReplicas(LAMMPS *lammps, int k, const std::string &groupName):k(k),selected(0) {
+        static char str[200];
+        const int64_t natoms=(int64_t)lammps_get_natoms(lammps);
+        if (natoms%k!=0) {
+            if (world->isLeader) {
+                fprintf(stderr, "The %lld atoms are not %d replicas of the same size\n", (long long)natoms, k);
+            }
+            MPI_Abort(world->comm, 1);
+        }
+        n=natoms/k;
+        for (int r=0;r<k;r++) {
+            sprintf(str,"group ffs_replica_%d id %lld:%lld",r,(long long)(r*n+1),(long long)((r+1)*n));
+            lammps_command(lammps,str);
+            sprintf(str,"group ffs_velocity_%d intersect %s ffs_replica_%d",r,groupName.c_str(),r);
+            lammps_command(lammps,str);
+        }
+        //the replicas may overlap, they only see themselves
+        for (int r=0;r<k;r++) {
+            for (int q=r+1;q<k;q++) {
+                sprintf(str,"neigh_modify exclude group ffs_replica_%d ffs_replica_%d",r,q);
+                lammps_command(lammps,str);
+            }
+        }
+        ids.resize(n);
+    }
+    int count() const {
+        return k;
+    }
+    int64_t atoms() const {
+        return n;
+    }
+    //the replica that snapshots capture and restore
+    void select(int r) {
+        selected=r;
+    }
+    //the atom ids of the selected replica
+    int *selectedIds() {
+        for (int64_t i=0;i<n;i++) {
+            ids[i]=selected*n+i+1;
+        }
+        return &ids[0];
+    }
+    //the group for the velocities of a replica
+    static const std::string velocityGroup(int r) {
+        static char c[100];
+        sprintf(c,"ffs_velocity_%d",r);
+        return c;
+    }
+private:
+    int k,selected;
+    int64_t n;
+    std::vector<int> ids;
+};
+FfsReplicas *replicas=0;
+
+//a configuration packed as binary: the box, then positions, velocities, image flags and types of all atoms ordered by atom id
+class FfsSnapshot: public FfsBranch {
+public:
+    struct Header {
+        int64_t natoms;
+        double boxlo[3],boxhi[3];
+        double xy,yz,xz;
+    };
+    std::vector<char> data;
+
+    //copy the state of the lammps instance, called by all process of the universe, the result is on all of them
+    void capture(LAMMPS *lammps) {
+        Header h;
+        int periodicity[3],boxChange;
+        lammps_extract_box(lammps, h.boxlo, h.boxhi, &h.xy, &h.yz, &h.xz, periodicity, &boxChange);
+        h.natoms=(int64_t)lammps_get_natoms(lammps);
+        if (replicas) {
+            h.natoms=replicas->atoms();
+        }
+        data.resize(bytes(h.natoms));
+        memcpy(&data[0], &h, sizeof(Header));
+        if (replicas) {
+            int *ids=replicas->selectedIds();
+            lammps_gather_atoms_subset(lammps, (char *)"x", 1, 3, h.natoms, ids, x());
+            lammps_gather_atoms_subset(lammps, (char *)"v", 1, 3, h.natoms, ids, v());
+            lammps_gather_atoms_subset(lammps, (char *)"image", 0, 3, h.natoms, ids, image());
+            lammps_gather_atoms_subset(lammps, (char *)"type", 0, 1, h.natoms, ids, type());
+            return ;
+        }
+        lammps_gather_atoms(lammps, (char *)"x", 1, 3, x());
+        lammps_gather_atoms(lammps, (char *)"v", 1, 3, v());
+        lammps_gather_atoms(lammps, (char *)"image", 0, 3, image());
+        lammps_gather_atoms(lammps, (char *)"type", 0, 1, type());
+    }
+
+    //put the saved state back into the lammps instance, called by all process of the universe with the same data
+    //the types are only kept for the export to xyz, they never change during a run
+    void restore(LAMMPS *lammps) {
+        Header *h=header();
+        //the replicas share the box, only the atoms of the selected one change
+        if (replicas) {
+            int *ids=replicas->selectedIds();
+            lammps_scatter_atoms_subset(lammps, (char *)"x", 1, 3, h->natoms, ids, x());
+            lammps_scatter_atoms_subset(lammps, (char *)"v", 1, 3, h->natoms, ids, v());
+            lammps_scatter_atoms_subset(lammps, (char *)"image", 0, 3, h->natoms, ids, image());
+            migrate(lammps);
+            return ;
+        }
+        //lammps_reset_box refuses an instance that holds atoms, the box is set like read_dump does
+        Domain *domain=lammps->domain;
+        for (int d=0;d<3;d++) {
+            domain->boxlo[d]=h->boxlo[d];
+            domain->boxhi[d]=h->boxhi[d];
+        }
+        if (domain->triclinic) {
+            domain->xy=h->xy;
+            domain->yz=h->yz;
+            domain->xz=h->xz;
+        }
+        domain->set_initial_box();
+        domain->set_global_box();
+        lammps->comm->set_proc_grid(0);
+        domain->set_local_box();
+        lammps_scatter_atoms(lammps, (char *)"x", 1, 3, x());
+        lammps_scatter_atoms(lammps, (char *)"v", 1, 3, v());
+        lammps_scatter_atoms(lammps, (char *)"image", 0, 3, image());
+        migrate(lammps);
+    }
+
+    //the scatter leaves every atom on the process that owned it before, they are moved to the process
+    //owning their new position as read_dump does, the neighbor exchange of the next setup only reaches adjacent ones
+    static void migrate(LAMMPS *lammps) {
+        Domain *domain=lammps->domain;
+        Atom *atom=lammps->atom;
+        for (int i=0;i<atom->nlocal;i++) {
+            domain->remap(atom->x[i],atom->image[i]);
+        }
+        if (domain->triclinic) {
+            domain->x2lamda(atom->nlocal);
+        }
+        domain->reset_box();
+        Irregular *irregular=new Irregular(lammps);
+        irregular->migrate_atoms(1);
+        delete irregular;
+        if (domain->triclinic) {
+            domain->lamda2x(atom->nlocal);
+        }
+        bigint nlocal=atom->nlocal,total;
+        MPI_Allreduce(&nlocal, &total, 1, MPI_LMP_BIGINT, MPI_SUM, lammps->world);
+        if (total!=atom->natoms) {
+            fprintf(stderr, "Restoring a configuration lost atoms: %lld of %lld left\n", (long long)total, (long long)atom->natoms);
+            MPI_Abort(world->comm, 1);
+        }
+    }
+
+    //send the snapshot of the local leader to all process of the universe
+    void share() {
+        int64_t n=data.size();
+        MPI_Bcast(&n, 1, MPI_LONG_LONG, 0, FfsBranch::commLocal);
+        data.resize(n);
+        MPI_Bcast(&data[0], n, MPI_CHAR, 0, FfsBranch::commLocal);
+    }
+
+    //the size of a snapshot with n atoms
+    static int64_t bytes(int64_t n) {
+        return sizeof(Header)+n*(3*(2*sizeof(double)+sizeof(int))+sizeof(int));
+    }
+private:
+    Header *header() {
+        return (Header *)&data[0];
+    }
+    double *x() {
+        return (double *)(&data[0]+sizeof(Header));
+    }
+    double *v() {
+        return x()+3*header()->natoms;
+    }
+    int *image() {
+        return (int *)(v()+3*header()->natoms);
+    }
+    int *type() {
+        return image()+3*header()->natoms;
+    }
+};
+//a single append-only data file plus an index of fixed records, shared by all universes,
+//so the pool costs two file opens per universe instead of one file per configuration
+class FfsPoolContainer: public FfsBranch {
+public:
+    struct Record {
+        char name[48];
+        int64_t offset;
+        int64_t size;
+    };
+    //called by all local leaders, the entries already in the files are kept
+    FfsPoolContainer(const char *dataName,const char *indexName) {
+        MPI_File_open(FfsBranch::commLeader, (char *)dataName, MPI_MODE_CREATE|MPI_MODE_RDWR, MPI_INFO_NULL, &dataFile);
+        MPI_File_open(FfsBranch::commLeader, (char *)indexName, MPI_MODE_CREATE|MPI_MODE_RDWR, MPI_INFO_NULL, &indexFile);
+        //counter 0 is the end of the data file, counter 1 the number of records
+        MPI_Offset sizes[2];
+        MPI_File_get_size(dataFile, &sizes[0]);
+        MPI_File_get_size(indexFile, &sizes[1]);
+        int64_t init[2]={sizes[0],sizes[1]/(MPI_Offset)sizeof(Record)};
+        counter=new FfsAtomicCounter(2,init);
+        known=0;
+        refresh();
+    }
+    ~FfsPoolContainer() {
+        delete counter;
+        MPI_File_close(&indexFile);
+        MPI_File_close(&dataFile);
+    }
+
+    //append an entry, only the calling local leader takes part
+    void append(const std::string &name,const std::vector<char> &data) {
+        Record r;
+        memset(&r, 0, sizeof(Record));
+        strncpy(r.name, name.c_str(), sizeof(r.name)-1);
+        r.size=data.size();
+        r.offset=counter->add(0,r.size);
+        const int64_t slot=counter->add(1,1);
+        MPI_File_write_at(dataFile, r.offset, (void *)&data[0], r.size, MPI_CHAR, MPI_STATUS_IGNORE);
+        MPI_File_write_at(indexFile, slot*sizeof(Record), &r, sizeof(Record), MPI_CHAR, MPI_STATUS_IGNORE);
+        entries[r.name]=r;
+    }
+
+    //the offset and size of an entry appended by this universe, or already known from the index
+    bool locate(const std::string &name,int64_t *entry) const {
+        std::map<std::string,Record>::const_iterator i=entries.find(name);
+        if (i==entries.end()) {
+            return false;
+        }
+        entry[0]=i->second.offset;
+        entry[1]=i->second.size;
+        return true;
+    }
+
+    //read an entry by its offset and size, it does not need to be in the index read by this universe
+    void readAt(const int64_t *entry,std::vector<char> *data) {
+        data->resize(entry[1]);
+        MPI_File_read_at(dataFile, entry[0], &(*data)[0], entry[1], MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+
+    //read an entry, only the calling local leader takes part
+    bool read(const std::string &name,std::vector<char> *data) {
+        std::map<std::string,Record>::const_iterator i=entries.find(name);
+        if (i==entries.end()) {
+            return false;
+        }
+        data->resize(i->second.size);
+        MPI_File_read_at(dataFile, i->second.offset, &(*data)[0], i->second.size, MPI_CHAR, MPI_STATUS_IGNORE);
+        return true;
+    }
+
+    //make the entries appended by every universe visible, called by all local leaders
+    void refresh() {
+        MPI_File_sync(dataFile);
+        MPI_File_sync(indexFile);
+        MPI_Barrier(FfsBranch::commLeader);
+        MPI_File_sync(dataFile);
+        MPI_File_sync(indexFile);
+        const int64_t total=counter->get(1);
+        if (total>known) {
+            std::vector<Record> records(total-known);
+            MPI_File_read_at(indexFile, known*sizeof(Record), &records[0], records.size()*sizeof(Record), MPI_CHAR, MPI_STATUS_IGNORE);
+            for (size_t i=0;i<records.size();i++) {
+                entries[records[i].name]=records[i];
+            }
+            known=total;
+        }
+    }
+private:
+    MPI_File dataFile,indexFile;
+    FfsAtomicCounter *counter;
+    //the number of records already read from the index
+    int64_t known;
+    std::map<std::string,Record> entries;
+};
+
+//the storage of the configurations that cross an interface, the name is the one generated by FfsFileTree
+class FfsPool: public FfsBranch {
+public:
+    virtual ~FfsPool() {
+    }
+    //save the current configuration of the universe under the name, called by all process of the universe
+    virtual void store(LAMMPS *lammps, const std::string &name)=0;
+    //replace the current configuration of the universe by the saved one, called by all process of the universe
+    void load(LAMMPS *lammps, const std::string &name) {
+        load(lammps,name,0);
+    }
+    //same, with the entry given by locate() in the universe that stored it, so the layer does not need to be committed
+    virtual void load(LAMMPS *lammps, const std::string &name, const int64_t *entry)=0;
+    //where the others can read a configuration stored by this universe, two numbers, false when the pool only works by name
+    virtual bool locate(const std::string &name, int64_t *entry) {
+        return false;
+    }
+    //all configurations of the layer have been stored, called by all process between two interfaces
+    virtual void commit(int layer) {
+    }
+protected:
+    //split the name "layer__branchId_n" into its numbers
+    static bool parseName(const std::string &name, int *layer, int *branch, int *n) {
+        return sscanf(name.c_str(), "%d__%d_%d", layer, branch, n)==3;
+    }
+};
+
+//the configurations are text files pool/xyz.<name>, only the positions are kept
+class FfsXyzPool: public FfsPool {
+public:
+    void store(LAMMPS *lammps, const std::string &name) {
+        static char strDump[100];
+        sprintf(strDump,"write_dump all xyz pool/xyz.%s",name.c_str());
+        lammps_command(lammps,strDump);
+    }
+    void load(LAMMPS *lammps, const std::string &name, const int64_t *entry) {
+        static char strReadData[100];
+        sprintf(strReadData,"read_dump pool/xyz.%s 0 x y z box no format xyz",name.c_str());
+        lammps_command(lammps,strReadData);
+    }
+};
+
+//the configurations stay in the memory of the local leader that stored them as FfsSnapshot,
+//every snapshot is attached to a dynamic one-sided window, so other universes can read it as soon as they know where it is
+class FfsMemoryPool: public FfsPool {
+public:
+    //spill: also append every snapshot to the container, so a restart can find the configurations
+    FfsMemoryPool(bool spill) {
+        window=MPI_WIN_NULL;
+        windowLayer=-1;
+        container=0;
+        if (local->isLeader) {
+            MPI_Win_create_dynamic(MPI_INFO_NULL, FfsBranch::commLeader, &window);
+            if (spill) {
+                container=new FfsPoolContainer("pool/pool.dat","pool/pool.idx");
+            }
+        }
+    }
+    ~FfsMemoryPool() {
+        //the collective free waits for the universes still reading, the buffers go after it
+        if (window!=MPI_WIN_NULL) {
+            MPI_Win_free(&window);
+        }
+        for (int i=0;i<(int)stored.size();i++) {
+            for (int j=0;j<(int)stored[i].size();j++) {
+                delete stored[i][j];
+            }
+        }
+        delete container;
+    }
+    void store(LAMMPS *lammps, const std::string &name) {
+        FfsSnapshot snapshot;
+        snapshot.capture(lammps);
+        if (!local->isLeader) {
+            return ;
+        }
+        int layer,branch,n;
+        parseName(name,&layer,&branch,&n);
+        if (layer+1>(int)stored.size()) {
+            stored.resize(layer+1);
+        }
+        std::vector< std::vector<char> *> &v=stored[layer];
+        if (n+1>(int)v.size()) {
+            v.resize(n+1,(std::vector<char> *)0);
+        }
+        //the vector is never resized again, so its buffer can stay attached
+        v[n]=new std::vector<char>();
+        v[n]->swap(snapshot.data);
+        MPI_Win_attach(window, &(*v[n])[0], v[n]->size());
+        if (container) {
+            container->append(name,*v[n]);
+        }
+    }
+    void load(LAMMPS *lammps, const std::string &name, const int64_t *entry) {
+        FfsSnapshot snapshot;
+        if (local->isLeader) {
+            int layer,branch,n;
+            parseName(name,&layer,&branch,&n);
+            if (!fetch(layer,branch,n,entry,&snapshot.data)&&!(container&&container->read(name,&snapshot.data))) {
+                fprintf(stderr, "Configuration %s is not in the pool (set pool_spill 1 to continue a pool_format memory run)\n", name.c_str());
+                MPI_Abort(world->comm, 1);
+            }
+        }
+        snapshot.share();
+        snapshot.restore(lammps);
+    }
+    //the entry is the address of the snapshot in the window of this universe and its size
+    bool locate(const std::string &name, int64_t *entry) {
+        int layer,branch,n;
+        if (!local->isLeader||!parseName(name,&layer,&branch,&n)||branch!=local->id) {
+            return false;
+        }
+        const std::vector<char> *data=find(layer,n);
+        if (!data) {
+            return false;
+        }
+        MPI_Aint address;
+        MPI_Get_address((void *)&(*data)[0], &address);
+        entry[0]=address;
+        entry[1]=data->size();
+        return true;
+    }
+
+    //tell every universe where the snapshots of the layer are, and forget the older ones
+    void commit(int layer) {
+        if (!local->isLeader) {
+            return ;
+        }
+        //the parents of the coming interface are the only snapshots still needed
+        for (int i=0;i<layer&&i<(int)stored.size();i++) {
+            release(i);
+        }
+        //entries[2n] and entries[2n+1] are the address and the size of the n-th snapshot
+        const int count=layer<(int)stored.size() ? stored[layer].size() : 0;
+        std::vector<int64_t> entries(2*count,0);
+        for (int i=0;i<count;i++) {
+            locate(FfsFileTree::nameOf(layer,local->id,i),&entries[2*i]);
+        }
+        std::vector<int> counts(FfsBranch::size),displs(FfsBranch::size);
+        int myCount=2*count;
+        MPI_Allgather(&myCount, 1, MPI_INT, &counts[0], 1, MPI_INT, FfsBranch::commLeader);
+        int all=0;
+        for (int i=0;i<FfsBranch::size;i++) {
+            displs[i]=all;
+            all+=counts[i];
+        }
+        std::vector<int64_t> allEntries(all);
+        MPI_Allgatherv(entries.empty() ? 0 : &entries[0], myCount, MPI_LONG_LONG, allEntries.empty() ? 0 : &allEntries[0], &counts[0], &displs[0], MPI_LONG_LONG, FfsBranch::commLeader);
+        remote.assign(FfsBranch::size, std::vector<int64_t>());
+        for (int i=0;i<FfsBranch::size;i++) {
+            remote[i].assign(allEntries.begin()+displs[i], allEntries.begin()+displs[i]+counts[i]);
+        }
+        windowLayer=layer;
+    }
+private:
+    FfsPoolContainer *container;
+    //stored[layer][n] is the n-th snapshot of this universe at the layer, attached to the window
+    std::vector< std::vector< std::vector<char> *> > stored;
+    MPI_Win window;
+    //remote[branch] lists address and size of the snapshots of that universe at the committed layer
+    int windowLayer;
+    std::vector< std::vector<int64_t> > remote;
+
+    const std::vector<char> *find(int layer, int n) const {
+        if (layer>=(int)stored.size()||n>=(int)stored[layer].size()) {
+            return 0;
+        }
+        return stored[layer][n];
+    }
+    void release(int layer) {
+        std::vector< std::vector<char> *> &v=stored[layer];
+        for (int i=0;i<(int)v.size();i++) {
+            if (v[i]) {
+                MPI_Win_detach(window, &(*v[i])[0]);
+                delete v[i];
+            }
+        }
+        v.clear();
+    }
+
+    //get a snapshot on the local leader, either from this universe or through the window
+    bool fetch(int layer, int branch, int n, const int64_t *entry, std::vector<char> *data) {
+        if (branch==local->id) {
+            const std::vector<char> *mine=find(layer,n);
+            if (mine) {
+                *data=*mine;
+                return true;
+            }
+            return false;
+        }
+        if (!entry) {
+            if (layer!=windowLayer||branch>=(int)remote.size()||2*n+1>=(int)remote[branch].size()||remote[branch][2*n+1]==0) {
+                return false;
+            }
+            entry=&remote[branch][2*n];
+        }
+        data->resize(entry[1]);
+        MPI_Win_lock(MPI_LOCK_SHARED, branch, 0, window);
+        MPI_Get(&(*data)[0], entry[1], MPI_CHAR, branch, (MPI_Aint)entry[0], entry[1], MPI_CHAR, window);
+        MPI_Win_unlock(branch, window);
+        return true;
+    }
+};
+
+//the configurations are snapshots in the container pool/pool.dat, indexed by pool/pool.idx
+class FfsContainerPool: public FfsPool {
+public:
+    FfsContainerPool() {
+        container=0;
+        if (local->isLeader) {
+            container=new FfsPoolContainer("pool/pool.dat","pool/pool.idx");
+        }
+    }
+    ~FfsContainerPool() {
+        delete container;
+    }
+    void store(LAMMPS *lammps, const std::string &name) {
+        FfsSnapshot snapshot;
+        snapshot.capture(lammps);
+        if (local->isLeader) {
+            container->append(name,snapshot.data);
+        }
+    }
+    void load(LAMMPS *lammps, const std::string &name, const int64_t *entry) {
+        FfsSnapshot snapshot;
+        if (local->isLeader) {
+            if (entry) {
+                container->readAt(entry,&snapshot.data);
+            }
+            else if (!container->read(name,&snapshot.data)) {
+                fprintf(stderr, "Configuration %s is not in pool/pool.idx\n", name.c_str());
+                MPI_Abort(world->comm, 1);
+            }
+        }
+        snapshot.share();
+        snapshot.restore(lammps);
+    }
+    //the entry is the offset and size in pool/pool.dat, written before the success is reported like the xyz files
+    bool locate(const std::string &name, int64_t *entry) {
+        return local->isLeader&&container->locate(name,entry);
+    }
+    //the entries of the other universes are read from the index once the layer is complete
+    void commit(int layer) {
+        if (local->isLeader) {
+            container->refresh();
+        }
+    }
+private:
+    FfsPoolContainer *container;
+};
+
+//set the velocity of atoms in gaussian distribution
+int createVelocity(LAMMPS *lammps, const std::string &groupName, int temp, FfsRandomGenerator *pRng) {
+    static char str[100];
+    int seed=pRng->get(FfsRandomGenerator::VELOCITY);
+    sprintf(str,"velocity %s create %d %d dist gaussian", groupName.c_str(), temp, seed);
+    //set the velocity of the atoms
+    lammps_command(lammps,str);
+    return seed;
+};
+//run the given number of steps, the instances of a universe may do it on several threads at once
+void runBatch(LAMMPS *lammps, int steps) {
+    char str[100];
+    sprintf(str,"run %d pre no post no",steps);
+    lammps_command(lammps,str);
+}
+
+//set the timestep, after a state was restored
+void resetTimestep(LAMMPS *lammps, int64_t timestep) {
+    static char str[100];
+    sprintf(str,"reset_timestep %lld",(long long)timestep);
+    lammps_command(lammps,str);
+}
+
+//set by SIGTERM with checkpoint_signal
+volatile sig_atomic_t ffsTerminated=0;
+void ffsOnTerminate(int) {
+    ffsTerminated=1;
+}
+
+//with checkpoint_every, the running trajectory of the universe and what it is for are written to pool/checkpoint.<universe>
+//every checkpoint_every steps, and with checkpoint_signal once when the job gets SIGTERM. a job started again with the file
+//there goes on from that state: the first part with its timestep, or the trial when its interface is run
+class FfsCheckpoint: public FfsBranch {
+public:
+    struct State {
+        int32_t magic;
+        //the interface of the tree the trial adds to, -1 in the first part
+        int32_t layer;
+        int32_t lambdaInit,lambdaNext,velocitySeed;
+        //in the first part, the trajectory has been back to lambda_A
+        int32_t ready;
+        int64_t timestep;
+        uint64_t drawn[FfsRandomGenerator::PURPOSES];
+        char xyzInit[48];
+    };
+    //filled by the checker before write()
+    State state;
+    //from the file of the previous job, kept apart as the universe may write others before it is used
+    State loaded;
+
+    //called by all process
+    FfsCheckpoint(FfsRandomGenerator *rng):rng(rng) {
+        every=ffsParams->getInt("checkpoint_every",0);
+        onSignal=ffsParams->getInt("checkpoint_signal",0);
+        sprintf(filename,"pool/checkpoint.%d",local->id);
+        if (onSignal) {
+            signal(SIGTERM,ffsOnTerminate);
+        }
+        written=false;
+        signalled=false;
+        savedSinceSignal=false;
+        isLoaded=false;
+        last=0;
+    }
+    bool enabled() const {
+        return every>0||onSignal;
+    }
+
+    //read the file left by the previous job, called by all process of the universe
+    void load() {
+        int64_t n=0;
+        FILE *f=0;
+        if (local->isLeader) {
+            f=fopen(filename,"rb");
+            if (f) {
+                fseek(f, 0, SEEK_END);
+                n=ftell(f)-sizeof(State);
+                fseek(f, 0, SEEK_SET);
+                if (n<0||fread(&loaded, sizeof(State), 1, f)!=1||loaded.magic!=MAGIC) {
+                    n=0;
+                }
+            }
+        }
+        MPI_Bcast(&n, 1, MPI_LONG_LONG, 0, FfsBranch::commLocal);
+        if (n>0) {
+            MPI_Bcast(&loaded, sizeof(State), MPI_CHAR, 0, FfsBranch::commLocal);
+            loadedSnapshot.data.resize(n);
+            if (local->isLeader) {
+                if (fread(&loadedSnapshot.data[0], 1, n, f)!=(size_t)n) {
+                    fprintf(stderr, "Checkpoint %s is truncated\n", filename);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+            MPI_Bcast(&loadedSnapshot.data[0], n, MPI_CHAR, 0, FfsBranch::commLocal);
+            isLoaded=true;
+            written=true;
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+    //true when the file had a trajectory of the first part (layer -1), or a trial adding to the tree of layer
+    bool pending(int layer) const {
+        return isLoaded&&loaded.layer==layer;
+    }
+    //put the loaded state into lammps, it is only used once
+    void restore(LAMMPS *lammps) {
+        isLoaded=false;
+        loadedSnapshot.restore(lammps);
+        resetTimestep(lammps, loaded.timestep);
+        rng->restore(loaded.drawn);
+        loadedSnapshot.data.clear();
+        if (local->isLeader) {
+            printf("[date=%d] [universe=%d] restarted from %s at step %lld\n", std::time(0), local->id, filename, (long long)loaded.timestep);
+        }
+    }
+
+    //a trajectory starts at timestep
+    void start(int64_t timestep) {
+        last=timestep;
+        savedSinceSignal=false;
+    }
+    //after a check that did not stop the trajectory, true when the state is to be written
+    //called by all process of the universe, with checkpoint_signal they agree on the signal, and after it
+    //every trajectory is written once, the job is about to end
+    bool due(int64_t timestep) {
+        bool now=every>0&&(timestep>=last+every||timestep<last);
+        if (onSignal&&!signalled) {
+            int x=ffsTerminated, y;
+            MPI_Allreduce(&x, &y, 1, MPI_INT, MPI_MAX, FfsBranch::commLocal);
+            signalled=y;
+        }
+        if (signalled&&!savedSinceSignal) {
+            savedSinceSignal=true;
+            now=true;
+        }
+        return now;
+    }
+    //write the state filled by the checker with the current configuration, called by all process of the universe
+    void write(LAMMPS *lammps) {
+        state.magic=MAGIC;
+        state.timestep=lammps->update->ntimestep;
+        rng->save(state.drawn);
+        snapshot.capture(lammps);
+        last=state.timestep;
+        if (local->isLeader) {
+            //the old file stays valid until the new one is complete
+            char temp[80];
+            sprintf(temp,"%s.tmp",filename);
+            FILE *f=fopen(temp,"wb");
+            if (!f) {
+                fprintf(stderr, "Cannot write the checkpoint %s\n", temp);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            fwrite(&state, sizeof(State), 1, f);
+            fwrite(&snapshot.data[0], 1, snapshot.data.size(), f);
+            fclose(f);
+            rename(temp,filename);
+            printf("[date=%d] [universe=%d] checkpoint at step %lld\n", std::time(0), local->id, (long long)state.timestep);
+        }
+        written=true;
+    }
+    //the trajectory has an outcome, a restart must not run it again
+    void discard() {
+        if (!written) {
+            return;
+        }
+        written=false;
+        if (local->isLeader) {
+            remove(filename);
+        }
+    }
+private:
+    static const int32_t MAGIC=0x46465343;
+    FfsRandomGenerator *rng;
+    int every,onSignal;
+    char filename[64];
+    FfsSnapshot snapshot,loadedSnapshot;
+    bool written,signalled,savedSinceSignal,isLoaded;
+    int64_t last;
+};
+//with checkpoint_every or checkpoint_signal
+FfsCheckpoint *checkpoint=0;
+
+//the steps between two lambda checks: check_every, or with check_tolerance a multiple of it that grows while lambda
+//is far from the interfaces. the parameters are read by every process, so it is only built by all of them together.
+//lambda moves by at most about rate*steps between two checks, so steps is chosen for rate*steps <= distance+check_tolerance,
+//and a crossing is missed by no more than check_tolerance
+class FfsCheckInterval {
+public:
+    FfsCheckInterval() {
+        every=ffsParams->getInt("check_every");
+        tolerance=ffsParams->getInt("check_tolerance",0);
+        maxSteps=ffsParams->getInt("check_max",10*every);
+        if (maxSteps<every) {
+            maxSteps=every;
+        }
+        reset();
+    }
+    //a new trajectory, the first checks are check_every apart
+    int reset() {
+        steps=every;
+        lastStep=-1;
+        rate=0;
+        return steps;
+    }
+    //after a check, distance is how far lambda is from the nearest interface that stops the trajectory
+    int next(int lambda, int64_t timestep, int distance) {
+        if (tolerance<=0) {
+            return every;
+        }
+        if (lastStep>=0&&timestep>lastStep) {
+            //lambda is an integer, an unchanged value still allows a change of one
+            double observed=std::max(std::abs(lambda-lastLambda),1)/(double)(timestep-lastStep);
+            //a fast change is remembered for a few checks
+            rate=std::max(observed,rate*0.5);
+        }
+        lastLambda=lambda;
+        lastStep=timestep;
+        if (rate<=0||distance<=0) {
+            steps=every;
+            return steps;
+        }
+        double allowed=(distance+tolerance)/rate;
+        //at most twice the previous interval, so a quiet stretch does not jump to check_max at once
+        allowed=std::min(allowed,2.0*steps);
+        steps=std::max(every,std::min(maxSteps,(int)allowed/every*every));
+        return steps;
+    }
+private:
+    int every,tolerance,maxSteps;
+    int steps;
+    int lastLambda;
+    int64_t lastStep;
+    double rate;
+};
+
+//anything that looks at lambda after some steps and tells if the integration goes on
+//check() also sets the steps to the next check
+class FfsChecker {
+public:
+    virtual ~FfsChecker() {
+    }
+    virtual bool check(int lambda, int64_t timestep)=0;
+    //true when check() stopped at reference because an interface was crossed, and lambda is past that interface too
+    virtual bool crossed(int lambda, int reference) const {
+        return false;
+    }
+    //what the trajectory is for, kept with a checkpoint
+    virtual void describe(FfsCheckpoint::State *state) const=0;
+    void start() {
+        steps=interval.reset();
+    }
+    int getSteps() const {
+        return steps;
+    }
+protected:
+    FfsCheckInterval interval;
+    int steps;
+};
+
+//the lambda of the current state, after a setup of the restored atoms
+int evaluateLambda(LAMMPS *lammps) {
+    lammps_command(lammps,(char *)"run 0 pre yes post no");
+    const double *lambdaReuslt=(const double *)lammps_extract_compute(lammps,(char *)"lambda",0,1);
+    return (int)lambdaReuslt[0];
+}
+
+//with crossing_frames, a ring of the last states of the universe taken between two checks, so the configuration
+//stored at a crossing is the first kept frame past the interface instead of the state at the check that saw it
+class FfsCrossingFrames {
+public:
+    FfsCrossingFrames(int n):frames(n),timesteps(n),head(0),count(0),located(false) {
+    }
+    //the steps between two frames when the next check is steps away
+    int spacing(int steps) const {
+        return std::max(1,steps/(int)frames.size());
+    }
+    //called by all process of the universe
+    void capture(LAMMPS *lammps) {
+        frames[head].capture(lammps);
+        timesteps[head]=lammps->update->ntimestep;
+        head=(head+1)%frames.size();
+        count=std::min(count+1,(int)frames.size());
+    }
+    //lambda was checked and nothing crossed, the frames before are not needed any more
+    void clear() {
+        count=0;
+    }
+
+    //the checker stopped at lambda on a crossing: scan the frames taken since the last check in order, evaluating
+    //lambda only on them, and leave the first one past the interface in lammps with its timestep. returns its lambda.
+    //lambda may cross and come back between two checks, so the frames are not bisected, there are only crossing_frames
+    int locate(LAMMPS *lammps, FfsChecker *checker, int lambda) {
+        latest.capture(lammps);
+        latestStep=lammps->update->ntimestep;
+        located=true;
+        std::vector<int> order;
+        for (int i=count; i>0; i--) {
+            order.push_back((head-i+frames.size())%frames.size());
+        }
+        count=0;
+        for (size_t i=0;i<order.size();i++) {
+            frames[order[i]].restore(lammps);
+            const int l=evaluateLambda(lammps);
+            if (checker->crossed(l,lambda)) {
+                resetTimestep(lammps, timesteps[order[i]]);
+                lammps_command(lammps,(char *)"run 0 pre yes post no");
+                return l;
+            }
+        }
+        //none of the frames crossed, the current state is the first one past the interface
+        if (!order.empty()) {
+            latest.restore(lammps);
+            resetTimestep(lammps, latestStep);
+            lammps_command(lammps,(char *)"run 0 pre yes post no");
+        }
+        return lambda;
+    }
+    //after locate(), put back the state at the check that saw the crossing, so the trajectory goes on from there
+    void back(LAMMPS *lammps) {
+        if (!located) {
+            return;
+        }
+        located=false;
+        latest.restore(lammps);
+        resetTimestep(lammps, latestStep);
+        lammps_command(lammps,(char *)"run 0 pre yes post no");
+    }
+private:
+    std::vector<FfsSnapshot> frames;
+    std::vector<int64_t> timesteps;
+    int head,count;
+    FfsSnapshot latest;
+    int64_t latestStep;
+    bool located;
+};
+
+//with trial_run single, the fix that checks lambda inside one long run
+FixFfsInterface *interfaceFix=0;
+//with crossing_frames, the frames of this universe
+FfsCrossingFrames *crossingFrames=0;
+struct FfsCheckCall {
+    FfsChecker *checker;
+    LAMMPS *lammps;
+};
+//0 stops the run, otherwise the steps to the next check
+int ffsCheckCallback(void *ptr, double lambda) {
+    FfsCheckCall *call=(FfsCheckCall *)ptr;
+    if (!call->checker->check((int)lambda, call->lammps->update->ntimestep)) {
+        return 0;
+    }
+    if (crossingFrames) {
+        crossingFrames->clear();
+    }
+    if (checkpoint&&checkpoint->due(call->lammps->update->ntimestep)) {
+        call->checker->describe(&checkpoint->state);
+        checkpoint->write(call->lammps);
+    }
+    return call->checker->getSteps();
+}
+//between two checks, with crossing_frames
+void ffsFrameCallback(void *ptr) {
+    crossingFrames->capture(((FfsCheckCall *)ptr)->lammps);
+}
+
+//integrate until checker->check() is false, pre and post are the setup and the statistics around the whole integration
+//either one run command per check, or a single run stopped by fix ffs/interface
+//returns the last lambda, or with crossing_frames the lambda of the first frame past the crossed interface
+int runChecked(LAMMPS *lammps, FfsChecker *checker, bool pre, bool post) {
+    checker->start();
+    if (checkpoint) {
+        checkpoint->start(lammps->update->ntimestep);
+    }
+    if (crossingFrames) {
+        crossingFrames->clear();
+    }
+    int lambda;
+    if (!interfaceFix) {
+        if (pre) {
+            lammps_command(lammps,(char *)"run 0 pre yes post no");
+        }
+        while (1) {
+            int left=checker->getSteps();
+            if (crossingFrames) {
+                const int every=crossingFrames->spacing(left);
+                for (; left>every; left-=every) {
+                    runBatch(lammps,every);
+                    crossingFrames->capture(lammps);
+                }
+            }
+            runBatch(lammps,left);
+            const double *lambdaReuslt=(const double *)lammps_extract_compute(lammps,(char *)"lambda",0,1);
+            lambda=(int)lambdaReuslt[0];
+            if (!checker->check(lambda, lammps->update->ntimestep)) {
+                break;
+            }
+            if (crossingFrames) {
+                crossingFrames->clear();
+            }
+            if (checkpoint&&checkpoint->due(lammps->update->ntimestep)) {
+                checker->describe(&checkpoint->state);
+                checkpoint->write(lammps);
+            }
+        }
+        if (post) {
+            lammps_command(lammps,(char *)"run 0 pre no post yes");
+        }
+    }
+    else {
+        FfsCheckCall call={checker,lammps};
+        interfaceFix->set_callback(ffsCheckCallback,&call,checker->getSteps());
+        static char str[100];
+        //the length is only a bound, the fix stops the run
+        sprintf(str,"run 1000000000 pre %s post %s",pre ? "yes" : "no",post ? "yes" : "no");
+        while (1) {
+            lammps_command(lammps,str);
+            if (interfaceFix->halted()) {
+                break;
+            }
+            sprintf(str,"run 1000000000 pre no post %s",post ? "yes" : "no");
+        }
+        interfaceFix->set_callback(0,0,0);
+        lambda=(int)interfaceFix->value();
+    }
+    if (crossingFrames&&checker->crossed(lambda,lambda)) {
+        lambda=crossingFrames->locate(lammps,checker,lambda);
+    }
+    return lambda;
+}
+
+void printBox(void *lmp, const std::string &xyzFinal) {
+  if (local->isLeader) {
+    static double low[3], high[3], xy, yz, xz;
+    static int periodicity[3], boxChange;
+    lammps_extract_box(lmp, low, high, &xy, &yz, &xz, periodicity, &boxChange);
+    printf("%s (%f, %f, %f) - (%f, %f, %f)\n", xyzFinal.c_str(), low[0], low[1], low[2], high[0], high[1], high[2]);
+  }
+}
+
+//print the status randomly according to the print_every
+void printStatus(const int print_every, const int timestep, const int current, const int target) {
+  if (local->isLeader) {
+    if (std::rand() < 1.0 * RAND_MAX / print_every) {
+      printf("[date=%d] [universe=%d] [steps=%d] : %d ... %d\n", std::time(0), local->id, timestep, current, target);
+    }
+  }
+}
+
+//block the dedicated coordinator until a worker reports a line or a success, instead of sleeping between probes
+void waitForEvent(FfsCountdown *fcd, FfsTrajectoryWriter *writer) {
+    FfsPersistentRecv *events[2]={fcd->event(),writer->event()};
+    //once the countdown is over there is nothing left to wait for
+    if (events[0]==0) {
+        return ;
+    }
+    FfsPersistentRecv::waitAny(2,events);
+}
+
+//runs the trials of one universe: load the parent, draw the velocities and integrate until lambda leaves (lambda_A, lambdaNext)
+class FfsShooter: public FfsBranch, public FfsChecker {
+public:
+    enum Outcome {FAILED, SUCCEEDED, STOPPED};
+    //what happens to a trial still running when its interface is complete
+    enum Drain {DROP, FINISH, RESUME, EXTRA};
+    FfsShooter(LAMMPS *lammps, FfsRandomGenerator *rng, FfsPool *pool, FfsTrajectoryWriter *writer):lammps(lammps),rng(rng),pool(pool),writer(writer) {
+        temperatureMean=ffsParams->getInt("temperature");
+        waterGroupName=ffsParams->getString("water_group");
+        print_every=ffsParams->getInt("print_every");
+        lambda_A=ffsParams->getVector("lambda")[0];
+        lambdaFinal=0;
+        saved=false;
+        const std::string drainName=ffsParams->getString("drain","drop");
+        drainSteps=ffsParams->getInt("drain_steps",0);
+        drain=DROP;
+        if (drainName=="finish") {
+            drain=FINISH;
+        }
+        else if (drainName=="resume") {
+            drain=RESUME;
+        }
+        else if (drainName=="extra") {
+            drain=EXTRA;
+        }
+        else if (world->isLeader&&drainName!="drop") {
+            fprintf(stderr, "Unknown drain \"%s\" in ffs input, using drop\n", drainName.c_str());
+        }
+        //a pipelined universe takes its next trial anyway, so resuming is the same as finishing
+        if (drain==RESUME&&ffsParams->getInt("pipeline_min",0)>0) {
+            drain=FINISH;
+        }
+        shots=std::max(ffsParams->getInt("shots_per_parent",1),1);
+        //the shots after the first one of a parent always come from the cache
+        cacheSize=std::max(ffsParams->getInt("parent_cache",0),shots>1 ? 1 : 0);
+    }
+
+    //shoot from xyzInit, a success is named by tree and stored in the pool, the trial is drained once quota->next() is false
+    //entry is where the parent is in the pool, or null to look it up by name
+    Outcome shoot(const std::string &xyzInit, int lambdaInit, const int64_t *entry, int lambdaNext, FfsFileTree *tree, FfsQuota *quota) {
+        //get the configuration from stored data
+        loadParent(xyzInit, entry);
+        trial.xyzInit=xyzInit;
+        trial.lambdaInit=lambdaInit;
+        trial.lambdaNext=lambdaNext;
+        trial.tree=tree;
+        //regenerate seeds
+        trial.velocitySeed=createVelocity(lammps, waterGroupName, temperatureMean, rng);
+        if (local->isLeader) {
+            printf("[date=%d] [universe=%d] [initialFile=%s] [velocitySeed=%d]\n", std::time(0), local->id, xyzInit.c_str(), trial.velocitySeed);
+        }
+        return run(quota,false);
+    }
+
+    //continue the trial of a checkpoint, it adds to tree like the other trials of the interface
+    Outcome restart(FfsCheckpoint *checkpoint, FfsFileTree *tree, FfsQuota *quota) {
+        const FfsCheckpoint::State &s=checkpoint->loaded;
+        trial.xyzInit=s.xyzInit;
+        trial.lambdaInit=s.lambdaInit;
+        trial.lambdaNext=s.lambdaNext;
+        trial.velocitySeed=s.velocitySeed;
+        trial.tree=tree;
+        checkpoint->restore(lammps);
+        if (local->isLeader) {
+            printf("[date=%d] [universe=%d] [restartedFile=%s] [velocitySeed=%d]\n", std::time(0), local->id, trial.xyzInit.c_str(), trial.velocitySeed);
+        }
+        return run(quota,false);
+    }
+
+    //with drain resume, continue the trial saved when the previous interface completed, it counts for that interface
+    //quota is the interface running now, or null; false when it completes before the resumed trial ends
+    bool resume(FfsQuota *quota) {
+        if (!saved) {
+            return true;
+        }
+        saved=false;
+        savedState.restore(lammps);
+        if (local->isLeader) {
+            printf("[date=%d] [universe=%d] [resumedFile=%s] [velocitySeed=%d]\n", std::time(0), local->id, trial.xyzInit.c_str(), trial.velocitySeed);
+        }
+        return run(quota,true)!=STOPPED||(quota==0||quota->next());
+    }
+
+    //the name given to the last success, and lambda at the end of the last trial
+    const std::string &getName() const {
+        return xyzFinal;
+    }
+    int getLambda() const {
+        return lambdaFinal;
+    }
+    //the number of trials shot in a row from a drawn parent
+    int getShots() const {
+        return shots;
+    }
+private:
+    LAMMPS *lammps;
+    FfsRandomGenerator *rng;
+    FfsPool *pool;
+    FfsTrajectoryWriter *writer;
+    int temperatureMean,print_every,lambda_A;
+    std::string waterGroupName;
+    std::string xyzFinal;
+    int lambdaFinal;
+    Drain drain;
+    //the steps a trial may still run once its interface is complete, 0 for no limit
+    int drainSteps;
+    int shots;
+    //the last parents loaded by the universe, the most recently used first
+    struct CachedParent {
+        std::string name;
+        FfsSnapshot state;
+    };
+    std::list<CachedParent> cache;
+    size_t cacheSize;
+    //the running trial, and with drain resume the one kept for later
+    struct Trial {
+        std::string xyzInit;
+        int lambdaInit,lambdaNext,velocitySeed;
+        FfsFileTree *tree;
+    } trial;
+    bool saved;
+    FfsSnapshot savedState;
+    //the state of the running trial seen by check()
+    FfsQuota *running;
+    bool resumed,draining;
+    int64_t drainStart;
+
+    //after every check of the trial
+    bool check(int lambda, int64_t timestep) {
+        lambdaFinal=lambda;
+        printStatus(print_every, timestep, lambda, trial.lambdaNext);
+        if (lambda<=lambda_A||lambda>=trial.lambdaNext) {
+            return false;
+        }
+        steps=interval.next(lambda, timestep, std::min(lambda-lambda_A, trial.lambdaNext-lambda));
+        writer->check();
+        //still asked while draining, the coordinator answers the other universes from there
+        const bool more=running==0||running->next();
+        if (!more&&resumed) {
+            return false;
+        }
+        if (!more&&!draining) {
+            if (drain!=FINISH&&drain!=EXTRA) {
+                return false;
+            }
+            draining=true;
+            drainStart=timestep;
+        }
+        return !(draining&&drainSteps>0&&timestep-drainStart>=drainSteps);
+    }
+    void describe(FfsCheckpoint::State *state) const {
+        state->layer=trial.tree->getLayer();
+        state->lambdaInit=trial.lambdaInit;
+        state->lambdaNext=trial.lambdaNext;
+        state->velocitySeed=trial.velocitySeed;
+        state->ready=0;
+        memset(state->xyzInit, 0, sizeof(state->xyzInit));
+        strncpy(state->xyzInit, trial.xyzInit.c_str(), sizeof(state->xyzInit)-1);
+    }
+    bool crossed(int lambda, int reference) const {
+        if (reference<=lambda_A) {
+            return lambda<=lambda_A;
+        }
+        return reference>=trial.lambdaNext&&lambda>=trial.lambdaNext;
+    }
+
+    //put the parent into the lammps instance, from the cache when the universe loaded it recently
+    //the names are the same on all process of the universe, so they all take the same branch
+    void loadParent(const std::string &xyzInit, const int64_t *entry) {
+        if (cacheSize==0) {
+            pool->load(lammps, xyzInit, entry);
+            return;
+        }
+        for (std::list<CachedParent>::iterator i=cache.begin();i!=cache.end();++i) {
+            if (i->name==xyzInit) {
+                cache.splice(cache.begin(), cache, i);
+                cache.front().state.restore(lammps);
+                return;
+            }
+        }
+        pool->load(lammps, xyzInit, entry);
+        //the least recently used entry is overwritten, so its buffer is kept
+        if (cache.size()<cacheSize) {
+            cache.push_front(CachedParent());
+        }
+        else {
+            cache.splice(cache.begin(), cache, --cache.end());
+        }
+        cache.front().name=xyzInit;
+        cache.front().state.capture(lammps);
+    }
+
+    //integrate the current trial, a resumed trial has its interface complete already and only stops when quota does
+    Outcome run(FfsQuota *quota, bool resumed) {
+        running=quota;
+        this->resumed=resumed;
+        draining=resumed;
+        drainStart=lammps->update->ntimestep;
+        lambdaFinal=runChecked(lammps,this,true,true);
+        if (checkpoint) {
+            checkpoint->discard();
+        }
+        const int lambda_calc=lambdaFinal;
+        xyzFinal.clear();
+        if (lambda_calc>lambda_A&&lambda_calc<trial.lambdaNext) {
+            if (drain==RESUME&&!resumed) {
+                savedState.capture(lammps);
+                saved=true;
+            }
+            return STOPPED;
+        }
+        //without a drain, a crossing seen together with the end of the interface is dropped
+        if (drain==DROP&&!quota->next()) {
+            return STOPPED;
+        }
+        int64_t timestep=lammps->update->ntimestep;
+        //the system has returned to the initial point, so print and continue
+        if (lambda_calc<=lambda_A) {
+            if (local->isLeader) {
+                printf("%3d (xyz.%s)  >==%010d %20lld==>  %3d (__________)\n", trial.lambdaInit, trial.xyzInit.c_str(), trial.velocitySeed, timestep, lambda_calc);
+            }
+            writer->record(FfsJournal::FAILURE, trial.xyzInit.c_str(), trial.lambdaInit, trial.velocitySeed, timestep, 0, lambda_calc);
+            return FAILED;
+        }
+        //a late success only counts for the crossing probability, the configuration is neither stored nor written
+        if (draining&&drain==EXTRA) {
+            if (local->isLeader) {
+                int layer,branch,n;
+                sscanf(trial.xyzInit.c_str(), "%d__%d_%d", &layer, &branch, &n);
+                printf("%3d (xyz.%s)  >==%010d %20lld==>  %3d (xyz.%d__%d_extra)\n", trial.lambdaInit, trial.xyzInit.c_str(), trial.velocitySeed, timestep, lambda_calc, layer+1, local->id);
+            }
+            writer->record(FfsJournal::EXTRA, trial.xyzInit.c_str(), trial.lambdaInit, trial.velocitySeed, timestep, 0, lambda_calc);
+            return SUCCEEDED;
+        }
+        //reach the next layer, store it
+        xyzFinal=trial.tree->add(lambda_calc);
+        writer->writeln(trial.xyzInit.c_str(),trial.lambdaInit,trial.velocitySeed,timestep,xyzFinal.c_str(),lambda_calc);
+        pool->store(lammps, xyzFinal);
+        printBox(lammps, xyzFinal);
+        return SUCCEEDED;
+    }
+};
+
+//pipelined interfaces: the world leader keeps a registry of the configurations found at each interface and hands out the trials,
+//so a universe can shoot from interface i as soon as pipeline_min configurations of it exist.
+//the parent is a slot drawn uniformly among the config_each_lambda first configurations of the interface, which is frozen
+//once they are all there. a draw that hits an empty slot is kept and served once the slot is filled, so the configurations
+//found early are not favoured
+class FfsPipeline: public FfsQuota {
+public:
+    struct Work {
+        int layer;
+        std::string xyzInit;
+        int lambdaInit;
+        bool hasEntry;
+        int64_t entry[2];
+    };
+    //trees holds all interfaces, committed; called by all process
+    FfsPipeline(const std::vector<FfsFileTree *> &trees, const std::vector<int> &quota, int minimum, FfsRandomGenerator *rng, FfsPool *pool, FfsTrajectoryWriter *writer, bool dedicated):quota(quota),minimum(minimum),rng(rng),pool(pool),writer(writer) {
+        layers=trees.size();
+        frozen.resize(layers);
+        signals.assign(layers,(FfsSignal *)0);
+        //the flux interface is complete, the others may be complete from the continued trajectory
+        for (int i=0;i<layers;i++) {
+            frozen[i]=i==0||trees[i]->getTotal()>=quota[i];
+            if (!frozen[i]&&local->isLeader&&FfsBranch::size>1) {
+                signals[i]=new FfsSignal();
+            }
+        }
+        current=0;
+        stopped=false;
+        last[0]=-1;
+        requestRecv=0;
+        if (world->isLeader) {
+            slots.resize(layers);
+            pending.resize(layers);
+            trials.assign(layers,0);
+            successes.assign(layers,0);
+            inflight.assign(layers,0);
+            for (int i=0;i<layers;i++) {
+                for (int k=0;k<trees[i]->getTotal();k++) {
+                    Slot slot;
+                    trees[i]->split(k,&slot.branch,&slot.n);
+                    slot.lambda=trees[i]->getLambda(k);
+                    slot.hasEntry=false;
+                    slots[i].push_back(slot);
+                }
+            }
+            active=dedicated ? FfsBranch::size-1 : FfsBranch::size;
+            if (FfsBranch::size>1) {
+                requestRecv=new FfsPersistentRecv(requestBuffer, 8, MPI_LONG_LONG, MPI_ANY_SOURCE, FfsBranch::TAG_PIPELINE_REQUEST, FfsBranch::commLeader);
+            }
+        }
+    }
+    ~FfsPipeline() {
+        delete requestRecv;
+        for (int i=0;i<layers;i++) {
+            delete signals[i];
+        }
+    }
+
+    //ask for the next trial, the outcome of the previous one goes with it; false when all interfaces are complete
+    //called by all process of a universe that runs trials
+    bool request(Work *work) {
+        int64_t msg[8];
+        if (local->isLeader) {
+            if (world->isLeader) {
+                handle(0,last,msg);
+            }
+            else {
+                MPI_Send(last, 8, MPI_LONG_LONG, 0, FfsBranch::TAG_PIPELINE_REQUEST, FfsBranch::commLeader);
+                MPI_Recv(msg, 8, MPI_LONG_LONG, 0, FfsBranch::TAG_PIPELINE_WORK, FfsBranch::commLeader, MPI_STATUS_IGNORE);
+            }
+        }
+        MPI_Bcast(msg, 8, MPI_LONG_LONG, 0, FfsBranch::commLocal);
+        if (msg[0]<0) {
+            return false;
+        }
+        work->layer=msg[0];
+        work->xyzInit=FfsFileTree::nameOf(work->layer-1,msg[1],msg[2]);
+        work->lambdaInit=msg[3];
+        work->hasEntry=msg[4];
+        work->entry[0]=msg[5];
+        work->entry[1]=msg[6];
+        current=work->layer;
+        stopped=false;
+        flag.reset();
+        return true;
+    }
+
+    //keep the outcome of the trial for the next request, xyzFinal is the name of a success
+    void report(int outcome, const std::string &xyzFinal, int lambda) {
+        last[0]=current;
+        last[1]=outcome;
+        last[2]=-1;
+        last[3]=lambda;
+        last[4]=0;
+        int layer,branch,n;
+        if (outcome==FfsShooter::SUCCEEDED&&sscanf(xyzFinal.c_str(), "%d__%d_%d", &layer, &branch, &n)==3) {
+            last[2]=n;
+            last[4]=pool->locate(xyzFinal,&last[5]);
+        }
+    }
+
+    //false once the interface of the running trial is complete
+    //the world leader keeps answering requests from here while its own trial is drained
+    bool next() {
+        if (local->isLeader) {
+            poll();
+        }
+        if (stopped) {
+            return false;
+        }
+        int decided=1;
+        if (local->isLeader) {
+            decided=frozen[current] ? 0 : 1;
+        }
+        if (flag.share(decided)==0) {
+            stopped=true;
+        }
+        return !stopped;
+    }
+
+    //the world leader serves the requests until every universe is done
+    void finish() {
+        if (world->isLeader) {
+            while (active>0) {
+                FfsPersistentRecv *events[2]={requestRecv,writer->event()};
+                FfsPersistentRecv::waitAny(2,events);
+                writer->check();
+                poll();
+            }
+        }
+    }
+private:
+    struct Slot {
+        int branch,n,lambda;
+        bool hasEntry;
+        int64_t entry[2];
+    };
+    const std::vector<int> quota;
+    int layers,minimum;
+    FfsRandomGenerator *rng;
+    FfsPool *pool;
+    FfsTrajectoryWriter *writer;
+    std::vector<bool> frozen;
+    //the freeze of each interface not complete at the start
+    std::vector<FfsSignal *> signals;
+    int current;
+    bool stopped;
+    FfsLocalFlag flag;
+    //the report sent with the next request: layer, outcome, n, lambda, hasEntry, entry
+    int64_t last[8];
+    FfsPersistentRecv *requestRecv;
+    int64_t requestBuffer[8];
+
+    //the registry, only on the world leader
+    std::vector< std::vector<Slot> > slots;
+    std::vector< std::deque<int> > pending;
+    std::vector<int> trials,successes,inflight;
+    //the universes not told yet that everything is done
+    int active;
+
+    //on the world leader, answer the arrived requests, elsewhere look for the frozen interfaces
+    void poll() {
+        if (world->isLeader) {
+            MPI_Status status;
+            while (requestRecv&&requestRecv->test(&status)) {
+                int64_t msg[8];
+                handle(status.MPI_SOURCE,requestBuffer,msg);
+                requestRecv->restart();
+                MPI_Send(msg, 8, MPI_LONG_LONG, status.MPI_SOURCE, FfsBranch::TAG_PIPELINE_WORK, FfsBranch::commLeader);
+            }
+        }
+        else {
+            for (int i=1;i<layers;i++) {
+                if (!frozen[i]&&signals[i]&&signals[i]->test()) {
+                    frozen[i]=true;
+                }
+            }
+        }
+    }
+
+    //book the report of universe branch and choose its next trial
+    void handle(int branch, const int64_t *report, int64_t *msg) {
+        const int layer=report[0];
+        if (layer>0) {
+            inflight[layer]--;
+            if (report[1]!=FfsShooter::STOPPED) {
+                trials[layer]++;
+            }
+            if (report[1]==FfsShooter::SUCCEEDED) {
+                successes[layer]++;
+                if (!frozen[layer]&&report[2]>=0) {
+                    Slot slot;
+                    slot.branch=branch;
+                    slot.n=report[2];
+                    slot.lambda=report[3];
+                    slot.hasEntry=report[4];
+                    slot.entry[0]=report[5];
+                    slot.entry[1]=report[6];
+                    slots[layer].push_back(slot);
+                    if ((int)slots[layer].size()>=quota[layer]) {
+                        freeze(layer);
+                    }
+                }
+            }
+        }
+        //the lowest interface that lacks running trials, or else the highest one that can start
+        int chosen=-1,open=-1;
+        for (int i=1;i<layers;i++) {
+            if (frozen[i]) {
+                continue;
+            }
+            if ((int)slots[i-1].size()<(frozen[i-1] ? 1 : minimum)) {
+                break;
+            }
+            open=i;
+            const double ratio=(successes[i]+1.0)/(trials[i]+2.0);
+            if (inflight[i]<(quota[i]-(int)slots[i].size())/ratio) {
+                chosen=i;
+                break;
+            }
+        }
+        if (chosen<0) {
+            chosen=open;
+        }
+        for (int i=0;i<8;i++) {
+            msg[i]=0;
+        }
+        if (chosen<0) {
+            //nothing can be shot anymore, the interfaces left without parents are closed too
+            for (int i=1;i<layers;i++) {
+                if (!frozen[i]) {
+                    freeze(i);
+                }
             }
+            msg[0]=-1;
+            active--;
+            return ;
         }
+        inflight[chosen]++;
+        const Slot &parent=slots[chosen-1][draw(chosen)];
+        msg[0]=chosen;
+        msg[1]=parent.branch;
+        msg[2]=parent.n;
+        msg[3]=parent.lambda;
+        msg[4]=parent.hasEntry;
+        msg[5]=parent.entry[0];
+        msg[6]=parent.entry[1];
     }
-    return false;
-}
 
-//
-class FfsRandomGenerator: public FfsBranch {
-    public:
-        //generate random seed in the leader process of local
-        FfsRandomGenerator() {
-            if (!local->isLeader) {
-                return ;
+    //the parent slot of a trial shooting to the layer, a kept draw whose slot is filled now comes first
+    int draw(int layer) {
+        const std::vector<Slot> &parents=slots[layer-1];
+        std::deque<int> &kept=pending[layer];
+        for (std::deque<int>::iterator i=kept.begin();i!=kept.end();++i) {
+            if (*i<(int)parents.size()) {
+                const int x=*i;
+                kept.erase(i);
+                return x;
+            }
+        }
+        const int range=frozen[layer-1] ? parents.size() : quota[layer-1];
+        while (1) {
+            const int x=rng->below(FfsRandomGenerator::COORDINATOR,range);
+            if (x<(int)parents.size()) {
+                return x;
             }
-            std::srand(std::time(0) + world->rank * 1234567);
-            std::rand();
-            std::rand();
+            kept.push_back(x);
+        }
+    }
+
+    void freeze(int layer) {
+        frozen[layer]=true;
+        printf("[date=%d] world leader froze interface %d with %d configurations\n", std::time(0), layer, (int)slots[layer].size());
+        if (signals[layer]) {
+            signals[layer]->raise();
+        }
+    }
+};
+
+//the first part: one long trajectory, a crossing counts once it has been back to lambda_A
+class FfsFluxRun: public FfsChecker {
+public:
+    FfsFluxRun(FfsCountdown *fcd, FfsTrajectoryWriter *writer, int lambda_A, int lambda_0, int print_every, int velocitySeed):fcd(fcd),writer(writer),lambda_A(lambda_A),lambda_0(lambda_0),print_every(print_every),velocitySeed(velocitySeed) {
+        ready=false;
+        crossing=false;
+    }
+    //go on from a checkpoint
+    void restart(const FfsCheckpoint::State &state) {
+        ready=state.ready;
+        velocitySeed=state.velocitySeed;
+    }
+    int getVelocitySeed() const {
+        return velocitySeed;
+    }
+    bool check(int lambda, int64_t timestep) {
+        printStatus(print_every, timestep, lambda, lambda_0);
+        crossing=false;
+        if (lambda<=lambda_A) {
+            ready=true;
         }
-        //generalize random number in main process and distrubute in all process
-        int get() {
-            int x;
+        //when the lambda evolved to be smaller than lambdaA and larger than lambda0, stop
+        if (ready&&lambda>=lambda_0) {
+            ready=false;
+            crossing=true;
+            return false;
+        }
+        //once back in A, only the crossing of lambda0 matters
+        steps=interval.next(lambda, timestep, ready ? lambda_0-lambda : std::min(lambda-lambda_A, lambda_0-lambda));
+        writer->check();
+        //if has reached the configuration number, then stop
+        return fcd->next();
+    }
+    bool crossed(int lambda, int reference) const {
+        return crossing&&lambda>=lambda_0;
+    }
+    void describe(FfsCheckpoint::State *state) const {
+        state->layer=-1;
+        state->lambdaInit=0;
+        state->lambdaNext=lambda_0;
+        state->velocitySeed=velocitySeed;
+        state->ready=ready;
+        memset(state->xyzInit, 0, sizeof(state->xyzInit));
+    }
+private:
+    FfsCountdown *fcd;
+    FfsTrajectoryWriter *writer;
+    int lambda_A,lambda_0,print_every,velocitySeed;
+    bool ready,crossing;
+};
+
+//with replicas k, a universe runs k trajectories at once in its lammps instance: every check reads the lambda of each
+//replica from the vector of compute lambda, and a replica whose trajectory has an outcome starts the next one while
+//the others keep running. the lines and records are the same as with one trajectory per universe
+//with instances k, the universe runs one trajectory in each of its k lammps instances the same way, the instances
+//run their batches at the same time on threads of their own, so one waits on its communication while another computes
+class FfsPackedRun: public FfsBranch {
+public:
+    //called by all process, instances are the lammps instances of the universe, the first one on local->comm
+    FfsPackedRun(const std::vector<LAMMPS *> &instances, FfsRandomGenerator *rng, FfsPool *pool, FfsTrajectoryWriter *writer):instances(instances),rng(rng),pool(pool),writer(writer) {
+        temperatureMean=ffsParams->getInt("temperature");
+        print_every=ffsParams->getInt("print_every");
+        check_every=ffsParams->getInt("check_every");
+        lambda_A=ffsParams->getVector("lambda")[0];
+        waterGroupName=ffsParams->getString("water_group");
+        slots.resize(replicas ? replicas->count() : instances.size());
+        values.resize(instances.size());
+        //two instances can only be in MPI at the same time with MPI_THREAD_MULTIPLE
+        int provided;
+        MPI_Query_thread(&provided);
+        if (instances.size()>1&&provided<MPI_THREAD_MULTIPLE) {
             if (local->isLeader) {
-                x=std::rand();
+                fprintf(stderr, "instances needs MPI_THREAD_MULTIPLE, the MPI library only provides the thread level %d\n", provided);
+            }
+            MPI_Abort(world->comm,1);
+        }
+    }
+
+    //draw the velocities of each trajectory, instead of one draw for the whole instance
+    void createVelocities() {
+        for (int r=0;r<(int)slots.size();r++) {
+            slots[r].velocitySeed=createVelocity(instanceOf(r), velocityGroup(r), temperatureMean, rng);
+        }
+    }
+
+    //the first part: a crossing of lambda_0 by a trajectory counts once it has been back to lambda_A and the equilibrium steps are over
+    void flux(FfsCountdown *fcd, FfsFileTree *tree, int lambda_0, int64_t equilibriumSteps) {
+        for (int r=0;r<(int)slots.size();r++) {
+            slots[r].ready=false;
+        }
+        while (1) {
+            runBatches();
+            if (!fcd->next()) {
+                break;
+            }
+            const int64_t timestep=instances[0]->update->ntimestep;
+            int biggest=0;
+            for (int r=0;r<(int)slots.size();r++) {
+                const int lambda=lambdaOf(r);
+                biggest=std::max(biggest,lambda);
+                if (lambda<=lambda_A) {
+                    slots[r].ready=true;
+                }
+                if (!slots[r].ready||lambda<lambda_0) {
+                    continue;
+                }
+                slots[r].ready=false;
+                if (timestep<=equilibriumSteps) {
+                    continue;
+                }
+                const std::string xyzFinal=tree->add(lambda);
+                writer->writeln((const char *)0,0,slots[r].velocitySeed,timestep,xyzFinal.c_str(),lambda);
+                select(r);
+                pool->store(instanceOf(r), xyzFinal);
+                printBox(instanceOf(r), xyzFinal);
+                fcd->done();
+            }
+            printStatus(print_every, timestep, biggest, lambda_0);
+            writer->check();
+        }
+    }
+
+    //the trials from the configurations of parents to lambdaNext, the successes are named by tree, until fcd is over
+    //the trials still running then are dropped
+    void shoot(FfsCountdown *fcd, FfsFileTree *parents, FfsFileTree *tree, FfsParentSelector *selector, int lambdaNext) {
+        for (int r=0;r<(int)slots.size();r++) {
+            slots[r].busy=false;
+        }
+        while (1) {
+            std::vector<bool> loaded(instances.size(),false);
+            for (int r=0;r<(int)slots.size();r++) {
+                if (!slots[r].busy) {
+                    const int x=selector->draw(rng);
+                    start(r, parents->getName(x), parents->getLambda(x));
+                    loaded[replicas ? 0 : r]=true;
+                }
+            }
+            //the restored atoms need new neighbor lists
+            for (size_t i=0;i<instances.size();i++) {
+                if (loaded[i]) {
+                    lammps_command(instances[i],(char *)"run 0 pre yes post no");
+                }
             }
-            MPI_Bcast(&x, 1, MPI_INT, 0, FfsBranch::commLocal);
-            return x;
+            runBatches();
+            if (!fcd->next()) {
+                break;
+            }
+            int biggest=0;
+            for (int r=0;r<(int)slots.size();r++) {
+                Slot &slot=slots[r];
+                const int lambda=lambdaOf(r);
+                const int64_t timestep=instanceOf(r)->update->ntimestep;
+                biggest=std::max(biggest,lambda);
+                if (lambda<=lambda_A) {
+                    if (local->isLeader) {
+                        printf("%3d (xyz.%s)  >==%010d %20lld==>  %3d (__________)\n", slot.lambdaInit, slot.xyzInit.c_str(), slot.velocitySeed, timestep, lambda);
+                    }
+                    writer->record(FfsJournal::FAILURE, slot.xyzInit.c_str(), slot.lambdaInit, slot.velocitySeed, timestep, 0, lambda);
+                    slot.busy=false;
+                }
+                else if (lambda>=lambdaNext) {
+                    const std::string xyzFinal=tree->add(lambda);
+                    writer->writeln(slot.xyzInit.c_str(),slot.lambdaInit,slot.velocitySeed,timestep,xyzFinal.c_str(),lambda);
+                    select(r);
+                    pool->store(instanceOf(r), xyzFinal);
+                    printBox(instanceOf(r), xyzFinal);
+                    fcd->done();
+                    slot.busy=false;
+                }
+            }
+            //one status line per check, like in the first part
+            printStatus(print_every, instances[0]->update->ntimestep, biggest, lambdaNext);
+            writer->check();
+        }
+        for (size_t i=0;i<instances.size();i++) {
+            lammps_command(instances[i],(char *)"run 0 pre no post yes");
+        }
+    }
+private:
+    std::vector<LAMMPS *> instances;
+    FfsRandomGenerator *rng;
+    FfsPool *pool;
+    FfsTrajectoryWriter *writer;
+    int temperatureMean,print_every,check_every,lambda_A;
+    std::string waterGroupName;
+    //the vector of compute lambda of each instance after the last batch
+    std::vector<const double *> values;
+    //the trajectory of each replica or instance
+    struct Slot {
+        bool busy,ready;
+        std::string xyzInit;
+        int lambdaInit,velocitySeed;
+    };
+    std::vector<Slot> slots;
+
+    LAMMPS *instanceOf(int r) const {
+        return instances[replicas ? 0 : r];
+    }
+    int lambdaOf(int r) const {
+        return replicas ? (int)values[0][2*r] : (int)values[r][0];
+    }
+    const std::string velocityGroup(int r) const {
+        return replicas ? FfsReplicas::velocityGroup(r) : waterGroupName;
+    }
+    //the replica that snapshots capture and restore, an instance holds one system
+    void select(int r) {
+        if (replicas) {
+            replicas->select(r);
+        }
+    }
+
+    //check_every steps of an instance and its lambda, the other instances of the process may do the same at once
+    static void batch(LAMMPS *lammps, int steps, const double **lambdas) {
+        runBatch(lammps, steps);
+        *lambdas=(const double *)lammps_extract_compute(lammps,(char *)"lambda",0,1);
+    }
+    //the first instance runs on the calling thread, the others on threads of their own, which are joined before
+    //the outcomes are handled, so the communication of the universe only happens between two batches
+    void runBatches() {
+        std::vector<std::thread> threads;
+        for (size_t i=1;i<instances.size();i++) {
+            threads.push_back(std::thread(batch, instances[i], check_every, &values[i]));
+        }
+        batch(instances[0], check_every, &values[0]);
+        for (size_t i=0;i<threads.size();i++) {
+            threads[i].join();
+        }
+    }
+
+    //load the parent into the replica or instance and draw its velocities
+    void start(int r, const std::string &xyzInit, int lambdaInit) {
+        Slot &slot=slots[r];
+        select(r);
+        pool->load(instanceOf(r), xyzInit);
+        slot.xyzInit=xyzInit;
+        slot.lambdaInit=lambdaInit;
+        slot.velocitySeed=createVelocity(instanceOf(r), velocityGroup(r), temperatureMean, rng);
+        slot.busy=true;
+        if (local->isLeader) {
+            printf("[date=%d] [universe=%d] [initialFile=%s] [velocitySeed=%d] [%s=%d]\n", std::time(0), local->id, xyzInit.c_str(), slot.velocitySeed, replicas ? "replica" : "instance", r);
         }
+    }
 };
 
-//set the velocity of atoms in gaussian distribution
-int createVelocity(LAMMPS *lammps, const std::string &groupName, int temp, FfsRandomGenerator *pRng) {
-    static char str[100];
-    int seed=pRng->get();
-    sprintf(str,"velocity %s create %d %d dist gaussian", groupName.c_str(), temp, seed);
-    //set the velocity of the atoms
-    lammps_command(lammps,str);
-    return seed;
+class FfsEquilibrium: public FfsBranch {
+public:
+    //with equilibration clone: the universes first..first+sources-1 run the equilibrium steps, every universe takes the state
+    //of one of them, draws its own velocities and runs decorrelation steps. the timestep is then set to equilibrium, so the
+    //flux time counted from the status lines is the same as when every universe equilibrates by itself.
+    //called by all process, a universe that keeps its own state (the coordinator, a checkpoint) only takes part in the broadcasts
+    //returns the velocity seed of the universe
+    int clone(LAMMPS *lammps, int equilibriumSteps, int first, int sources, int decorrelation, bool keep,
+              const std::string &groupName, int temperature, FfsRandomGenerator *rng, int velocitySeed) {
+        static char str[100];
+        sources=std::max(1,std::min(sources,FfsBranch::size-first));
+        const bool source=local->id>=first&&local->id<first+sources;
+        FfsSnapshot state,copy;
+        if (source&&!keep) {
+            sprintf(str,"run %d pre no post no",equilibriumSteps);
+            lammps_command(lammps,str);
+            state.capture(lammps);
+        }
+        //one broadcast per source among the local leaders, a universe keeps the one it starts from
+        if (local->isLeader) {
+            for (int i=0;i<sources;i++) {
+                FfsSnapshot &x=(first+i==local->id) ? state : copy;
+                int64_t n=x.data.size();
+                MPI_Bcast(&n, 1, MPI_LONG_LONG, first+i, FfsBranch::commLeader);
+                x.data.resize(n);
+                if (n>0) {
+                    MPI_Bcast(&x.data[0], n, MPI_CHAR, first+i, FfsBranch::commLeader);
+                }
+                if (!source&&local->id%sources==i) {
+                    state.data.swap(copy.data);
+                }
+            }
+        }
+        if (keep) {
+            return velocitySeed;
+        }
+        //a source that kept its checkpoint sent nothing, its universes equilibrate by themselves
+        int cloned=!state.data.empty();
+        MPI_Bcast(&cloned, 1, MPI_INT, 0, FfsBranch::commLocal);
+        if (!source&&!cloned) {
+            sprintf(str,"run %d pre no post no",equilibriumSteps);
+            lammps_command(lammps,str);
+        }
+        else if (!source) {
+            state.share();
+            state.restore(lammps);
+            velocitySeed=createVelocity(lammps, groupName, temperature, rng);
+            lammps_command(lammps,(char *)"run 0 pre yes post no");
+            if (decorrelation>0) {
+                sprintf(str,"run %d pre no post no",decorrelation);
+                lammps_command(lammps,str);
+            }
+            if (local->isLeader) {
+                printf("[date=%d] [universe=%d] cloned the equilibrium of universe %d\n", std::time(0), local->id, first+local->id%sources);
+            }
+        }
+        resetTimestep(lammps, equilibriumSteps);
+        return velocitySeed;
+    }
 };
-void runBatch(LAMMPS *lammps) {
-    static char str[100];
-    static bool inited=false;
-    if (!inited) {
-        //get the value of parameter "check_every"
-        int everyStep=ffsParams->getInt("check_every");
-        sprintf(str,"run %d pre no post no",everyStep);
-        inited=true;
-    }
-    if (lammps) {
-        //run check_every step
-        lammps_command(lammps,str);
+
+//reads the lammps input script and the files it names on the world leader only, and writes the files once per node
+//into a node-local directory, so hundreds of universes don't read the data and potential files at the same time
+class FfsStaging {
+public:
+    //the index of the lammps input script in the command line, -1 when lammps would read it from stdin
+    static int findScript(int argc, char **argv) {
+        for (int i=1;i+1<argc;i++) {
+            if (strcmp(argv[i],"-in")==0||strcmp(argv[i],"-i")==0) {
+                return i+1;
+            }
+        }
+        return -1;
     }
-}
 
-void printBox(void *lmp, const std::string &xyzFinal) {
-  if (local->isLeader) {
-    static double low[3], high[3], xy, yz, xz;
-    static int periodicity[3], boxChange;
-    lammps_extract_box(lmp, low, high, &xy, &yz, &xz, periodicity, &boxChange);
-    printf("%s (%f, %f, %f) - (%f, %f, %f)\n", xyzFinal.c_str(), low[0], low[1], low[2], high[0], high[1], high[2]);
-  }
-}
+    //called by all process, files is the "stage_files" line of the ffs input and directory the node-local place
+    FfsStaging(int argc, char **argv, const std::string &files, const std::string &directory) {
+        const int iScript=findScript(argc,argv);
+        //lammps must not open the script itself, the universes run the staged copy
+        for (int i=0;i<argc;i++) {
+            if (i!=iScript&&i+1!=iScript) {
+                args.push_back(argv[i]);
+            }
+        }
+        args.push_back(0);
+        MPI_Comm_split_type(world->comm,MPI_COMM_TYPE_SHARED,world->rank,MPI_INFO_NULL,&nodeComm);
+        MPI_Comm_rank(nodeComm,&nodeRank);
+        MPI_Comm_split(world->comm,nodeRank==0 ? 0 : MPI_UNDEFINED,world->rank,&nodeLeaders);
+        //the directory is named after the process id of the world leader, the same on every node
+        long id=getpid();
+        MPI_Bcast(&id,1,MPI_LONG,0,world->comm);
+        dir=directory+"/ffs."+std::to_string(id);
+        if (nodeRank==0&&mkdir(dir.c_str(),0700)!=0) {
+            fprintf(stderr, "Cannot create the staging directory %s\n", dir.c_str());
+            MPI_Abort(world->comm,1);
+        }
+        std::vector<std::string> names;
+        char name[1024];
+        int n;
+        for (const char *p=files.c_str();sscanf(p,"%1023s%n",name,&n)==1;p+=n) {
+            names.push_back(name);
+        }
+        std::string text;
+        if (world->isLeader) {
+            text=readFile(argv[iScript]);
+        }
+        for (size_t i=0;i<names.size();i++) {
+            const std::string &name=names[i];
+            const size_t slash=name.find_last_of('/');
+            staged.push_back(dir+"/"+std::to_string(i)+"."+(slash==std::string::npos ? name : name.substr(slash+1)));
+            if (nodeRank==0) {
+                std::string content;
+                if (world->isLeader) {
+                    content=readFile(name);
+                }
+                share(&content,nodeLeaders);
+                writeFile(staged[i],content);
+            }
+            if (world->isLeader) {
+                replace(&text,name,staged[i]);
+            }
+        }
+        //a bcast does not make the other process of the node wait, they must not read a staged file before it is complete
+        MPI_Barrier(nodeComm);
+        share(&text,world->comm);
+        script=text;
+        if (world->isLeader) {
+            printf("staged %d files in %s\n", (int)names.size(), dir.c_str());
+        }
+    }
 
-//print the status randomly according to the print_every
-void printStatus(const int print_every, const int timestep, const int current, const int target) {
-  if (local->isLeader) {
-    if (std::rand() < 1.0 * RAND_MAX / print_every) {
-      printf("[date=%d] [universe=%d] [steps=%d] : %d ... %d\n", std::time(0), local->id, timestep, current, target);
+    //the command line for lammps, without the input script
+    int getArgc() const {
+        return args.size()-1;
+    }
+    char **getArgv() {
+        return &args[0];
+    }
+
+    //runs the script in a lammps instance of the universe
+    void run(LAMMPS *lammps) {
+        lammps_commands_string(lammps,(char *)script.c_str());
     }
-  }
-}
+
+    //called by all process, once all universes of the node have run the script the staged files are removed
+    ~FfsStaging() {
+        MPI_Barrier(nodeComm);
+        if (nodeRank==0) {
+            for (size_t i=0;i<staged.size();i++) {
+                unlink(staged[i].c_str());
+            }
+            rmdir(dir.c_str());
+        }
+        if (nodeLeaders!=MPI_COMM_NULL) {
+            MPI_Comm_free(&nodeLeaders);
+        }
+        MPI_Comm_free(&nodeComm);
+    }
+private:
+    std::vector<char *> args;
+    MPI_Comm nodeComm,nodeLeaders;
+    int nodeRank;
+    std::string dir,script;
+    std::vector<std::string> staged;
+
+    static std::string readFile(const std::string &name) {
+        FILE *f=fopen(name.c_str(),"rb");
+        if (!f) {
+            fprintf(stderr, "Cannot read %s to stage it\n", name.c_str());
+            MPI_Abort(world->comm,1);
+        }
+        std::string content;
+        char buffer[65536];
+        size_t n;
+        while ((n=fread(buffer,1,sizeof(buffer),f))>0) {
+            content.append(buffer,n);
+        }
+        fclose(f);
+        return content;
+    }
+
+    static void writeFile(const std::string &name, const std::string &content) {
+        FILE *f=fopen(name.c_str(),"wb");
+        if (!f||fwrite(content.data(),1,content.size(),f)!=content.size()) {
+            fprintf(stderr, "Cannot write the staged file %s\n", name.c_str());
+            MPI_Abort(world->comm,1);
+        }
+        fclose(f);
+    }
+
+    //the content of rank 0 goes to all process of comm
+    static void share(std::string *content, MPI_Comm comm) {
+        int64_t n=content->size();
+        MPI_Bcast(&n,1,MPI_INT64_T,0,comm);
+        content->resize(n);
+        //in pieces, the count of MPI_Bcast is an int
+        const int64_t piece=1<<30;
+        for (int64_t i=0;i<n;i+=piece) {
+            MPI_Bcast(&(*content)[i],(int)std::min(piece,n-i),MPI_CHAR,0,comm);
+        }
+    }
+
+    //replaces the words of the script equal to the file name, or to ./ and the file name
+    static void replace(std::string *text, const std::string &name, const std::string &path) {
+        const std::string SPACE=" \t\n\v\f\r";
+        size_t begin=text->find_first_not_of(SPACE);
+        while (begin!=std::string::npos) {
+            size_t end=text->find_first_of(SPACE,begin);
+            if (end==std::string::npos) {
+                end=text->length();
+            }
+            const std::string word=text->substr(begin,end-begin);
+            if (word==name||word=="./"+name) {
+                text->replace(begin,end-begin,path);
+                end=begin+path.length();
+            }
+            begin=text->find_first_not_of(SPACE,end);
+        }
+    }
+};
 
 /**
 *\param argc the number of parameters
 *\param argv a pointer to the pointer of char, used for store the value of parameter
 */
 int ffs_main(int argc, char **argv) {
-    //initialization, 0 can be treated as nullptr
-    runBatch(0);
-    LAMMPS *lammps=new LAMMPS(argc,argv,local->comm);
-    //process all the lammps input file
-    lammps->input->file();
+    //"stage_files" are read once by the world leader and shared through a node-local directory
+    FfsStaging *staging=0;
+    if (ffsParams->has("stage_files")) {
+        if (FfsStaging::findScript(argc,argv)>=0) {
+            staging=new FfsStaging(argc,argv,ffsParams->getString("stage_files"),ffsParams->getString("stage_dir","/dev/shm"));
+        }
+        else if (world->isLeader) {
+            fprintf(stderr, "stage_files needs the lammps input given with -in, each universe reads the files\n");
+        }
+    }
+    //"dedicated" keeps universe 0 for coordination only, "shared" lets every universe run trials
+    //and the world leader handles the messages between its own batches
+    const std::string coordinator=ffsParams->getString("coordinator","dedicated");
+    if (world->isLeader&&coordinator!="dedicated"&&coordinator!="shared") {
+        fprintf(stderr, "Unknown coordinator \"%s\" in ffs input, using dedicated\n", coordinator.c_str());
+    }
+    const bool dedicatedCoordinator=coordinator!="shared";
+    //with replicas k > 1, the lammps instance holds k copies of the system and the universe runs a trajectory in each
+    const int nReplicas=ffsParams->getInt("replicas",1);
+    //with instances k > 1, the universe runs k lammps instances, each on a copy of its communicator
+    int nInstances=ffsParams->getInt("instances",1);
+    if (nReplicas>1&&nInstances>1) {
+        if (world->isLeader) {
+            fprintf(stderr, "instances is not used with replicas\n");
+        }
+        nInstances=1;
+    }
+    //the same in all universes, the parameters read below depend on it
+    const bool packing=nReplicas>1||nInstances>1;
+    //the coordinator runs no trajectory, one instance is enough there
+    if (nInstances<1||(dedicatedCoordinator && local->id == 0)) {
+        nInstances=1;
+    }
+    std::vector<LAMMPS *> instances;
+    std::vector<MPI_Comm> instanceComms;
+    for (int i=0;i<nInstances;i++) {
+        MPI_Comm comm=local->comm;
+        if (i>0) {
+            MPI_Comm_dup(local->comm,&comm);
+            instanceComms.push_back(comm);
+        }
+        LAMMPS *instance=staging ? new LAMMPS(staging->getArgc(),staging->getArgv(),comm) : new LAMMPS(argc,argv,comm);
+        //process all the lammps input file
+        if (staging) {
+            staging->run(instance);
+        }
+        else {
+            instance->input->file();
+        }
+        instances.push_back(instance);
+    }
+    delete staging;
+    LAMMPS *lammps=instances[0];
+    if (nReplicas>1) {
+        replicas=new FfsReplicas(lammps, nReplicas, ffsParams->getString("water_group"));
+    }
+    if (packing) {
+        const char *unused[]={"trial_run","crossing_frames","checkpoint_every","checkpoint_signal","equilibration","pipeline_min","shots_per_parent","parent_cache","drain","drain_steps"};
+        for (int i=0;i<(int)(sizeof(unused)/sizeof(unused[0]));i++) {
+            if (ffsParams->has(unused[i])&&world->isLeader) {
+                fprintf(stderr, "%s is not used with %s\n", unused[i], replicas ? "replicas" : "instances");
+            }
+        }
+    }
+    //"batches" runs check_every steps per run command, "single" runs each trial as one run checked by fix ffs/interface
+    const std::string trialRun=packing ? std::string("batches") : ffsParams->getString("trial_run","batches");
+    //the number of frames kept between two checks to find the first one past an interface, 0 for none
+    const int nFrames=packing ? 0 : ffsParams->getInt("crossing_frames",0);
+    if (nFrames>0) {
+        crossingFrames=new FfsCrossingFrames(nFrames);
+    }
+    if (trialRun=="single") {
+        static char str[100];
+        //frames can fall between the multiples of check_every, so the fix then looks at every step
+        sprintf(str,"fix ffs_interface all ffs/interface %d lambda",nFrames>0 ? 1 : ffsParams->getInt("check_every"));
+        lammps_command(lammps,str);
+        interfaceFix=(FixFfsInterface *)lammps->modify->get_fix_by_id("ffs_interface");
+        if (crossingFrames) {
+            interfaceFix->set_frames(ffsFrameCallback,nFrames);
+        }
+    }
+    else if (world->isLeader&&trialRun!="batches") {
+        fprintf(stderr, "Unknown trial_run \"%s\" in ffs input, using batches\n", trialRun.c_str());
+    }
     //lammps_command(lammps,(char *)"set group all image 0 0 0");
     FfsTrajectoryReader continuedTrajectory;
-    FfsTrajectoryWriter fileTrajectory;
+    FfsTrajectoryWriter *fileTrajectory=new FfsTrajectoryWriter();
     //get the value of the specific parameter
     int temperatureMean=ffsParams->getInt("temperature");
     const std::string waterGroupName = ffsParams->getString("water_group");
@@ -761,151 +3578,232 @@ int ffs_main(int argc, char **argv) {
     const std::vector<int> lambdaList=ffsParams->getVector("lambda");
     static int lambda_A=lambdaList[0];
     FfsRandomGenerator rng;
+    rng.resume(continuedTrajectory.getRestartIndex(),continuedTrajectory.getDrawn());
+    //a packed run has no checkpoint, and must not take over SIGTERM for one
+    checkpoint=packing ? 0 : new FfsCheckpoint(&rng);
+    if (checkpoint&&checkpoint->enabled()) {
+        checkpoint->load();
+    }
+    else {
+        delete checkpoint;
+        checkpoint=0;
+    }
     FfsFileTree *lastTree,*currentTree;
+    //where the configurations crossing an interface are kept, "xyz" files, "memory" snapshots or a "container" file
+    std::string poolFormat=ffsParams->getString("pool_format","xyz");
+    //read_dump finds the atoms by id, so xyz files cannot go to another replica
+    if (replicas&&poolFormat!="container") {
+        poolFormat="memory";
+    }
+    FfsPool *pool;
+    if (poolFormat=="memory") {
+        pool=new FfsMemoryPool(ffsParams->getInt("pool_spill",0));
+    }
+    else if (poolFormat=="container") {
+        pool=new FfsContainerPool();
+    }
+    else {
+        if (world->isLeader&&poolFormat!="xyz") {
+            fprintf(stderr, "Unknown pool_format \"%s\" in ffs input, using xyz\n", poolFormat.c_str());
+        }
+        pool=new FfsXyzPool();
+    }
 
+    FfsPackedRun *packed=packing ? new FfsPackedRun(instances, &rng, pool, fileTrajectory) : 0;
     //set velocity of the atoms and get the seed
-	int velocitySeed=createVelocity(lammps, waterGroupName, temperatureMean, &rng);
+	int velocitySeed=0;
+	if (packed) {
+		packed->createVelocities();
+	}
+	else {
+		velocitySeed=createVelocity(lammps, waterGroupName, temperatureMean, &rng);
+	}
     //parameter is number of configurations collected at each interface, if there's continue file, then continue the process
-	FfsCountdown *fcd = new FfsCountdown(config_each_lambda[0] - continuedTrajectory.countPrecalculated(0)); 
-	lammps_command(lammps,(char *)"run 0 pre yes post no");
+	FfsCountdown *fcd = new FfsCountdown(config_each_lambda[0] - continuedTrajectory.countPrecalculated(0), 0); 
+	for (size_t i=0;i<instances.size();i++) {
+		lammps_command(instances[i],(char *)"run 0 pre yes post no");
+	}
+	//"each" universe runs the equilibrium steps, or they "clone" the state of equilibrate_universes of them
+	const std::string equilibration=packing ? std::string("each") : ffsParams->getString("equilibration","each");
+	if (equilibration=="clone") {
+		const int first=dedicatedCoordinator ? 1 : 0;
+		const int sources=ffsParams->getInt("equilibrate_universes",1);
+		const int decorrelation=ffsParams->getInt("decorrelation",0);
+		const bool keep=(dedicatedCoordinator && local->id == 0)||(checkpoint&&checkpoint->pending(-1));
+		velocitySeed=FfsEquilibrium().clone(lammps, equilibriumSteps, first, sources, decorrelation, keep, waterGroupName, temperatureMean, &rng, velocitySeed);
+	}
+	else if (world->isLeader&&equilibration!="each") {
+		fprintf(stderr, "Unknown equilibration \"%s\" in ffs input, using each\n", equilibration.c_str());
+	}
+	FfsFluxRun fluxRun(fcd, fileTrajectory, lambda_A, lambdaList[1], print_every, velocitySeed);
+	//the trajectory of the first part left by the previous job, with its timestep, so the equilibrium is not run again
+	if (checkpoint&&checkpoint->pending(-1)&&!(dedicatedCoordinator && local->id == 0)) {
+		fluxRun.restart(checkpoint->loaded);
+		checkpoint->restore(lammps);
+		lammps_command(lammps,(char *)"run 0 pre yes post no");
+	}
 	lastTree=0;
 	currentTree=new FfsFileTree(&continuedTrajectory,0);
 	while (1) {
-		if (local->id == 0) {
-		  sleep(1);
+		if (dedicatedCoordinator && local->id == 0) {
+		  waitForEvent(fcd, fileTrajectory);
           //receive the file information from all other process
-		  fileTrajectory.check();
+		  fileTrajectory->check();
 		  if (!fcd->next()) {
 			delete fcd;
 			break;
 		  }
 		  continue;
 		}
-		bool ready=false;
-		int lambda;
-		while (1) {
-            //run check_every steps
-			runBatch(lammps);
-			const double *lambdaReuslt=(const double *)lammps_extract_compute(lammps,(char *)"lambda",0,1);
-			lambda=(int)lambdaReuslt[0];
-			static int lambda_0=lambdaList[1];
-            //update is a member variant with class "update" in lammps object, and ntimestep stores the timestep now 
-			const int64_t timestep = lammps->update->ntimestep;
-			printStatus(print_every, timestep, lambda, lambda_0);
-			if (lambda<=lambda_A) {
-				ready=true;
-			}
-            //when the lambda evolved to be smaller than lambdaA and larger than lambda0, break loop
-			if (ready&&lambda>=lambda_0) {
-				ready=false;
-				break;
-			}
-			fileTrajectory.check();
-            //if has reached the configuration number, then break loop
-			if (!fcd->next()) {
-				break;
-			}
+		if (packed) {
+			packed->flux(fcd, currentTree, lambdaList[1], equilibriumSteps);
+			delete fcd;
+			break;
 		}
+		//run until the trajectory comes from lambda_A to lambda_0, or the countdown is over
+		const int lambda=runChecked(lammps, &fluxRun, false, false);
 		if (!fcd->next()) {
+			if (checkpoint) {
+				checkpoint->discard();
+			}
 			delete fcd;
 			break;
 		}
 		int64_t timestep=lammps->update->ntimestep;
         //if the timestep hasn't reach the equilibriumsteps, then rerun the loop
 		if (timestep <= equilibriumSteps) {
+		  if (crossingFrames) {
+			crossingFrames->back(lammps);
+		  }
 		  continue;
 		}
-		static char strDump[100];
         //xyzFinal is a string that can reflect the layer number and current lambda value, 0__4_0 stands for NO.0 layer, branchId 4, and 0 stands for the size of lambda vector in the branch
 		const std::string xyzFinal=currentTree->add(lambda);
-		sprintf(strDump,"write_dump all xyz pool/xyz.%s",xyzFinal.c_str());
         /*
         *write the trajectory information into the file "trajectory.out.txt", exemple: "  ___ (__________)  >==1777855480               106360==>   40 (xyz.0__4_0)"
         *here the 1777855480 stands for velocity seed, and 106360 stands for the timestep number, 40 is the value of lambda
         */
-		fileTrajectory.writeln((const char *)0,0,velocitySeed,timestep,xyzFinal.c_str(),lambda);
-		lammps_command(lammps,strDump);
+		fileTrajectory->writeln((const char *)0,0,fluxRun.getVelocitySeed(),timestep,xyzFinal.c_str(),lambda);
+		pool->store(lammps, xyzFinal);
         //print the parameter of box
 		printBox(lammps, xyzFinal);
+		//the trajectory goes on from the check that saw the crossing
+		if (crossingFrames) {
+			crossingFrames->back(lammps);
+		}
+		//a restart goes on after this crossing, not from before it
+		if (checkpoint) {
+			fluxRun.describe(&checkpoint->state);
+			checkpoint->write(lammps);
+		}
 		fcd->done();
 	}
-	lammps_command(lammps,(char *)"run 0 pre no post yes");
+	for (size_t i=0;i<instances.size();i++) {
+		lammps_command(instances[i],(char *)"run 0 pre no post yes");
+	}
     
     //the second part, loop until finish
     const int n=lambdaList.size();
-    for (int i=1;i+1<n;i++) {
+    FfsShooter shooter(lammps, &rng, pool, fileTrajectory);
+    FfsParentSelector selector(n);
+    //with pipeline_min > 0, the trials of interface i+1 start once pipeline_min configurations of interface i exist
+    const int pipelineMin=packing ? 0 : ffsParams->getInt("pipeline_min",0);
+    if (pipelineMin>0) {
+        std::vector<FfsFileTree *> trees(1,currentTree);
+        for (int i=1;i+1<n;i++) {
+            trees.push_back(new FfsFileTree(&continuedTrajectory,i));
+        }
+        //the only commits of the run, for the flux interface and the continued trajectory
+        for (int i=0;i<(int)trees.size();i++) {
+            trees[i]->commit();
+        }
+        pool->commit(0);
+        FfsPipeline *pipeline=new FfsPipeline(trees, config_each_lambda, pipelineMin, &rng, pool, fileTrajectory, dedicatedCoordinator);
+        FfsPipeline::Work work;
+        while (!(dedicatedCoordinator && local->id == 0) && pipeline->request(&work)) {
+            const int outcome=shooter.shoot(work.xyzInit, work.lambdaInit, work.hasEntry ? work.entry : 0, lambdaList[work.layer+1], trees[work.layer], pipeline);
+            pipeline->report(outcome, shooter.getName(), shooter.getLambda());
+        }
+        pipeline->finish();
+        delete pipeline;
+        for (int i=0;i<(int)trees.size();i++) {
+            delete trees[i];
+        }
+        currentTree=0;
+    }
+    for (int i=1;pipelineMin<=0&&i+1<n;i++) {
         delete lastTree;
         lastTree=currentTree;
         currentTree=new FfsFileTree(&continuedTrajectory,i);
         lastTree->commit();
-        FfsCountdown *fcd = new FfsCountdown(config_each_lambda[i] - continuedTrajectory.countPrecalculated(i));  
+        pool->commit(i-1);
+        FfsCountdown *fcd = new FfsCountdown(config_each_lambda[i] - continuedTrajectory.countPrecalculated(i), i);
         const int lambda_next=lambdaList[i+1];
+        selector.prepare(lastTree,&rng);
+        //with shots_per_parent k, a drawn parent is shot k times before the next draw
+        int initConfig=0;
+        int shotsLeft=0;
+        //a trial kept by drain resume runs first, the interface does not wait for it
+        if (!(dedicatedCoordinator && local->id == 0) && !shooter.resume(fcd)) {
+            delete fcd;
+            continue;
+        }
         while (1) {
-            //the process with id 0 only possess file information
-            if (local->id == 0) {
-              sleep(0.5);
-              fileTrajectory.check();
+            //with a dedicated coordinator, the process with id 0 only possess file information
+            if (dedicatedCoordinator && local->id == 0) {
+              waitForEvent(fcd, fileTrajectory);
+              fileTrajectory->check();
               if (!fcd->next()) {
                 delete fcd;
                 break;
               }
               continue;
             }
-            static char strReadData[100];
-            const int initConfig=rng.get();
-            const std::string xyzInit=lastTree->getName(initConfig);
-            const int lambdaInit=lastTree->getLambda(initConfig);
-            //get the configuration from stored data
-            sprintf(strReadData,"read_dump pool/xyz.%s 0 x y z box no format xyz",xyzInit.c_str());
-            lammps_command(lammps,strReadData);
-            //regenerate seeds
-            int velocitySeed=createVelocity(lammps, waterGroupName, temperatureMean, &rng);
-            if (local->isLeader) {
-                printf("[date=%d] [universe=%d] [initialFile=%s] [velocitySeed=%d]\n", std::time(0), local->id, xyzInit.c_str(), velocitySeed);
-            }
-            lammps_command(lammps,(char *)"run 0 pre yes post no");
-            int lambda_calc;
-            while (1) {
-                runBatch(lammps);
-                const double *lambdaReuslt=(const double *)lammps_extract_compute(lammps,(char *)"lambda",0,1);
-                lambda_calc=(int)lambdaReuslt[0];
-                const int64_t timestep = lammps->update->ntimestep;
-                printStatus(print_every, timestep, lambda_calc, lambda_next);
-                if (lambda_calc<=lambda_A||lambda_calc>=lambda_next) {
-                    break;
-                }
-                fileTrajectory.check();
-                if (!fcd->next()) {
-                    break;
-                }
-            }
-            lammps_command(lammps,(char *)"run 0 pre no post yes");
-            if (!fcd->next()) {
+            if (packed) {
+                packed->shoot(fcd, lastTree, currentTree, &selector, lambda_next);
                 delete fcd;
                 break;
             }
-            int64_t timestep=lammps->update->ntimestep;
-            //the system has returned to the initial point, so print and continue
-            if (lambda_calc<=lambda_A) {
-              if (local->isLeader) {
-                printf("%3d (xyz.%s)  >==%010d %20lld==>  %3d (__________)\n", lambdaInit, xyzInit.c_str(), velocitySeed, timestep, lambda_calc);
-              }
-              continue;
+            int outcome;
+            //the trial of this interface that was running when the previous job stopped
+            if (checkpoint&&checkpoint->pending(i)) {
+                outcome=shooter.restart(checkpoint, currentTree, fcd);
+            }
+            else {
+                if (shotsLeft==0) {
+                    initConfig=selector.draw(&rng);
+                    shotsLeft=shooter.getShots();
+                }
+                shotsLeft--;
+                outcome=shooter.shoot(lastTree->getName(initConfig), lastTree->getLambda(initConfig), 0, lambda_next, currentTree, fcd);
             }
-            //if reach the next layer, store it
-            if (lambda_calc>=lambda_next) {
-                static char strDump[100];
-                const std::string xyzFinal=currentTree->add(lambda_calc);
-                sprintf(strDump,"write_dump all xyz pool/xyz.%s",xyzFinal.c_str());
-                fileTrajectory.writeln(xyzInit.c_str(),lambdaInit,velocitySeed,timestep,xyzFinal.c_str(),lambda_calc);
-                lammps_command(lammps,strDump);
-                printBox(lammps, xyzFinal);
+            if (outcome==FfsShooter::SUCCEEDED) {
                 fcd->done();
-                continue;
+            }
+            //a drained trial still ends with an outcome
+            if (outcome==FfsShooter::STOPPED||!fcd->next()) {
+                delete fcd;
+                break;
             }
         }
     }
-    delete lammps;
+    if (!(dedicatedCoordinator && local->id == 0)) {
+        shooter.resume(0);
+    }
+    delete lastTree;
+    delete currentTree;
+    delete pool;
+    delete crossingFrames;
+    delete checkpoint;
+    delete packed;
+    delete replicas;
+    delete fileTrajectory;
+    for (size_t i=0;i<instances.size();i++) {
+        delete instances[i];
+    }
+    for (size_t i=0;i<instanceComms.size();i++) {
+        MPI_Comm_free(&instanceComms[i]);
+    }
     delete local;
     delete world;
     return 0;
@@ -1,2 +1,3 @@
+bool ffsThreaded(int argc, char **argv);
 bool ffsRequested(int argc, char **argv);
 int ffs_main(int argc, char **argv);
@@ -0,0 +1,170 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#include <cstring>
+
+#include "fix_ffs_interface.h"
+#include "update.h"
+#include "modify.h"
+#include "compute.h"
+#include "timer.h"
+#include "error.h"
+
+using namespace LAMMPS_NS;
+using namespace FixConst;
+
+/* ----------------------------------------------------------------------
+   fix ID group ffs/interface N compute-ID
+   every N steps the first value of the global compute is given to the
+   callback set by the ffs driver, the run stops like with fix halt when it
+   returns 0, otherwise it returns the steps to the next check. with set_frames() the driver is also called
+   at evenly spaced steps between two checks, to keep the states there
+------------------------------------------------------------------------- */
+
+FixFfsInterface::FixFfsInterface(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg)
+{
+  if (narg != 5) error->all(FLERR,"Illegal fix ffs/interface command");
+
+  nevery = utils::inumeric(FLERR, arg[3], false, lmp);
+  if (nevery <= 0) error->all(FLERR,"Illegal fix ffs/interface command");
+
+  int n = strlen(arg[4]) + 1;
+  idcompute = new char[n];
+  strcpy(idcompute,arg[4]);
+
+  compute = NULL;
+  lambda = 0.0;
+  halt = 0;
+  nextcheck = 0;
+  callback = NULL;
+  callbackPtr = NULL;
+  frame = NULL;
+  nframes = 0;
+  nextframe = 0;
+  framespacing = 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+FixFfsInterface::~FixFfsInterface()
+{
+  delete [] idcompute;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int FixFfsInterface::setmask()
+{
+  int mask = 0;
+  mask |= END_OF_STEP;
+  mask |= POST_RUN;
+  return mask;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixFfsInterface::init()
+{
+  int icompute = modify->find_compute(idcompute);
+  if (icompute < 0)
+    error->all(FLERR,"Compute ID for fix ffs/interface does not exist");
+  compute = modify->compute[icompute];
+  if (!compute->vector_flag && !compute->scalar_flag)
+    error->all(FLERR,"Fix ffs/interface compute does not calculate a global scalar or vector");
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixFfsInterface::end_of_step()
+{
+  if (update->ntimestep < nextcheck) {
+    if (frame && callback && update->ntimestep >= nextframe) {
+      frame(callbackPtr);
+      nextframe += framespacing;
+    }
+    return;
+  }
+
+  modify->clearstep_compute();
+
+  if (compute->vector_flag) {
+    if (!(compute->invoked_flag & Compute::INVOKED_VECTOR)) {
+      compute->compute_vector();
+      compute->invoked_flag |= Compute::INVOKED_VECTOR;
+    }
+    lambda = compute->vector[0];
+  } else {
+    if (!(compute->invoked_flag & Compute::INVOKED_SCALAR)) {
+      compute->scalar = compute->compute_scalar();
+      compute->invoked_flag |= Compute::INVOKED_SCALAR;
+    }
+    lambda = compute->scalar;
+  }
+
+  // the value is global, so all procs take the same decision
+
+  int steps = nevery;
+  if (callback) steps = callback(callbackPtr,lambda);
+  if (steps <= 0) {
+    halt = 1;
+    timer->force_timeout();
+    return;
+  }
+
+  schedule(steps);
+  modify->addstep_compute(nextcheck);
+}
+
+/* ----------------------------------------------------------------------
+   the next run starts normally, as with fix halt error continue
+------------------------------------------------------------------------- */
+
+void FixFfsInterface::post_run()
+{
+  timer->reset_timeout();
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixFfsInterface::set_callback(Callback f, void *ptr, int steps)
+{
+  callback = f;
+  callbackPtr = ptr;
+  halt = 0;
+  schedule(steps);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void FixFfsInterface::set_frames(FrameCallback f, int n)
+{
+  frame = f;
+  nframes = n;
+}
+
+/* ----------------------------------------------------------------------
+   the next check in steps, kept on multiples of N, and the frames before it
+------------------------------------------------------------------------- */
+
+void FixFfsInterface::schedule(int steps)
+{
+  if (steps < nevery) steps = nevery;
+  steps = steps / nevery * nevery;
+  nextcheck = update->ntimestep + steps;
+  if (nframes > 0) {
+    framespacing = steps / nframes;
+    if (framespacing < 1) framespacing = 1;
+    nextframe = update->ntimestep + framespacing;
+  }
+}
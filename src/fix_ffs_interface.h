@@ -0,0 +1,83 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef FIX_CLASS
+
+FixStyle(ffs/interface,FixFfsInterface)
+
+#else
+
+#ifndef LMP_FIX_FFS_INTERFACE_H
+#define LMP_FIX_FFS_INTERFACE_H
+
+#include "fix.h"
+
+namespace LAMMPS_NS {
+
+class FixFfsInterface : public Fix {
+ public:
+  // called with the value after every check, the run stops when it returns 0,
+  // otherwise it returns the steps to the next check
+  typedef int (*Callback)(void *, double);
+  // called between two checks, with the pointer given to set_callback
+  typedef void (*FrameCallback)(void *);
+
+  FixFfsInterface(class LAMMPS *, int, char **);
+  ~FixFfsInterface();
+  int setmask();
+  void init();
+  void end_of_step();
+  void post_run();
+
+  void set_callback(Callback, void *, int);
+  void set_frames(FrameCallback, int);
+  int halted() const { return halt; }
+  double value() const { return lambda; }
+
+ private:
+  char *idcompute;
+  class Compute *compute;
+  double lambda;
+  int halt;
+  bigint nextcheck;
+  Callback callback;
+  void *callbackPtr;
+  FrameCallback frame;
+  int nframes,framespacing;
+  bigint nextframe;
+
+  void schedule(int);
+};
+
+}
+
+#endif
+#endif
+
+/* ERROR/WARNING messages:
+
+E: Illegal ... command
+
+Self-explanatory.  Check the input script syntax and compare to the
+documentation for the command.  You can use -echo screen as a
+command-line option when running LAMMPS to see the offending line.
+
+E: Compute ID for fix ffs/interface does not exist
+
+Self-explanatory.
+
+E: Fix ffs/interface compute does not calculate a global scalar or vector
+
+The lambda compute must be global, like compute biggest.
+
+*/
@@ -45,7 +45,12 @@ static void finalize()
 
 int main(int argc, char **argv)
 {
-  MPI_Init(&argc, &argv);
+  // with instances in the ffs input, the lammps instances of a universe run on threads of their own
+  if (ffsThreaded(argc, argv)) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+  } else
+    MPI_Init(&argc, &argv);
   MPI_Comm lammps_comm = MPI_COMM_WORLD;
 
 #if defined(LMP_MDI)